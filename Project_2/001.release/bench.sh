@@ -0,0 +1,63 @@
+#!/bin/bash
+# bench.sh: serve the mkcorpus tree with webserver and webserver_multi in
+# turn, drive each with the client and print a CSV line per run. Every
+# knob can be overridden from the environment, e.g.
+#	THREADS="8 32" CRASH=0 RATE=5 make bench
+#
+# The crash column is the -c percentage. The server rolls it once per
+# connection, when a worker takes the connection. Over keep-alive a run
+# opens only a handful of connections, so crash rows instead have the
+# client open a new connection for every request (per_conn 1, client -k 1).
+# Each thread count gets one such row per crash rate, crash 0 included,
+# to compare against. Those rows also pay the server's one second sleep
+# per connection. They measure how throughput and latency fall as workers
+# die and are replaced, not peak throughput; the per_conn 0 rows do that.
+#
+# That sleep caps a worker at one new connection a second, so unless RATE
+# is given each run sends half as many requests a second as it has
+# workers. A saturated server would only measure its own backlog.
+THREADS=${THREADS:-"1 4 16"}
+CRASH=${CRASH:-"0 5"}
+RATE=${RATE:-}
+DURATION=${DURATION:-30}
+CONNS=${CONNS:-64}
+PORT=${PORT:-8480}
+CORPUS=${CORPUS:-bench_root}
+LOGS=${LOGS:-bench_logs}
+
+here=$(cd "$(dirname "$0")" && pwd)
+scenario=$(mktemp)
+trap 'rm -f "$scenario"' EXIT
+[ -r "$CORPUS.scen" ] || { echo "$CORPUS.scen: not found, run make bench" >&2; exit 1; }
+mkdir -p "$LOGS"
+
+# run NAME THREADS CRASH PER_CONN COMMAND...: one server, one client run, one line
+run() {
+	local name=$1 threads=$2 crash=$3 per_conn=$4 log="$LOGS/$1-t$2-c$3-k$4.log" pid i result
+	local rate=${RATE:-$(awk "BEGIN { print $2 / 2 }")}
+	shift 4
+	{ cat "$CORPUS.scen"; echo "steady $DURATION $rate"; } > "$scenario"
+	(cd "$CORPUS" && exec "$@") > "$log" 2>&1 &
+	pid=$!
+	for i in $(seq 50); do
+		grep -q listening "$log" && break
+		sleep 0.1
+	done
+	result=$("$here/client" -C -s "$scenario" -t 2 -k "$per_conn" 127.0.0.1 "$PORT" "$CONNS")
+	kill -INT $pid
+	wait $pid
+	echo "$name,$threads,$crash,$per_conn,$rate,$DURATION,$CONNS,${result:-,,,,,,,,,}"
+	PORT=$((PORT + 1))
+}
+
+echo "server,threads,crash,per_conn,rate,duration,connections,completed,failed,unsent,req_s,mb_s,p50_us,p90_us,p99_us,p999_us,max_us"
+# a crash takes down the only thread webserver has, so it only runs crash free; and
+# an idle kept-alive connection holds that thread until it times out, so it gets a connection per request
+run webserver 1 0 1 "$here/webserver" "$PORT"
+for t in $THREADS; do
+	run webserver_multi "$t" 0 0 "$here/webserver_multi" "$PORT" "$t"
+	[ -z "$(echo $CRASH | tr -d ' 0')" ] && continue
+	for c in $CRASH; do
+		run webserver_multi "$t" "$c" 1 "$here/webserver_multi" -c "$c" "$PORT" "$t"
+	done
+done
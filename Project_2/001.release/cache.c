@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "cache.h"
+#include "header.h"
+#include "docroot.h"
+
+/*
+ * A miss being read from disk. Threads that miss on the same key while
+ * it is in flight wait for its result instead of reading the file again,
+ * so a cold start or a changed popular file costs one read, not one per
+ * worker.
+ */
+struct load {
+	const char *key; // the loading thread's path
+	unsigned int hash;
+	int done;
+	int r; // what cache_get() returns
+	struct stat st;
+	struct cache_entry *e;
+	int refs; // the loader and each waiter
+	struct load *next;
+};
+
+struct shard {
+	pthread_mutex_t lock;
+	pthread_cond_t loaded; // some load in this shard is done
+	struct cache_entry *buckets[CACHE_BUCKETS];
+	struct cache_entry *head, *tail;
+	struct load *loading;
+	size_t bytes;
+};
+
+static struct shard shards[CACHE_SHARDS];
+
+void cache_init()
+{
+	int i;
+
+	memset(shards, 0, sizeof(shards));
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		pthread_cond_init(&shards[i].loaded, NULL);
+	}
+}
+
+static void variant_free(struct cache_variant *v)
+{
+	free(v->header);
+	free(v->body);
+	free(v);
+}
+
+static void entry_free(struct cache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < ENC_COUNT; i++)
+		if (e->enc[i]) variant_free(e->enc[i]);
+	free(e->key);
+	free(e->header);
+	free(e->body);
+	free(e);
+}
+
+void cache_release(struct cache_entry *e)
+{
+	if (__sync_sub_and_fetch(&e->refs, 1) == 0) entry_free(e);
+}
+
+static void lru_unlink(struct shard *s, struct cache_entry *e)
+{
+	if (e->prev) e->prev->next = e->next; else s->head = e->next;
+	if (e->next) e->next->prev = e->prev; else s->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(struct shard *s, struct cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = s->head;
+	if (s->head) s->head->prev = e; else s->tail = e;
+	s->head = e;
+}
+
+// Unhook e from its shard and drop the reference the cache held. Called with s->lock held.
+static void shard_remove(struct shard *s, struct cache_entry *e)
+{
+	struct cache_entry **pp = &s->buckets[e->hash % CACHE_BUCKETS];
+
+	while (*pp && *pp != e) pp = &(*pp)->hnext;
+	if (*pp) *pp = e->hnext;
+	lru_unlink(s, e);
+	s->bytes -= e->len + e->extra;
+	cache_release(e);
+}
+
+static struct cache_entry *shard_find(struct shard *s, const char *key, unsigned int hash)
+{
+	struct cache_entry *e;
+
+	for (e = s->buckets[hash % CACHE_BUCKETS]; e; e = e->hnext)
+		if (e->hash == hash && strcmp(e->key, key) == 0) return e;
+	return NULL;
+}
+
+static void shard_insert(struct shard *s, struct cache_entry *e)
+{
+	struct cache_entry *old;
+
+	if ((old = shard_find(s, e->key, e->hash)) != NULL) shard_remove(s, old);
+	while (s->tail && s->bytes + e->len > CACHE_MAX_BYTES / CACHE_SHARDS) {
+		shard_remove(s, s->tail);
+		metrics_inc(cache_evictions);
+	}
+	e->hnext = s->buckets[e->hash % CACHE_BUCKETS];
+	s->buckets[e->hash % CACHE_BUCKETS] = e;
+	lru_push(s, e);
+	s->bytes += e->len;
+}
+
+static struct cache_entry *entry_new(const char *path, unsigned int hash, struct stat *st, int type,
+	char *header, int header_len, char *body, size_t len)
+{
+	struct cache_entry *e = calloc(1, sizeof(*e));
+
+	e->key = strdup(path);
+	e->hash = hash;
+	e->type = type;
+	e->header = malloc(header_len ? header_len : 1);
+	memcpy(e->header, header, header_len);
+	e->header_len = header_len;
+	e->body = body;
+	e->len = len;
+	e->mode = st->st_mode & S_IFMT;
+	e->mtime = st->st_mtime;
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	etag_format(e->etag, st);
+	e->checked = time(NULL);
+	e->refs = 1;
+	return e;
+}
+
+// Read a regular file that is already open and fstat()ed into a new entry.
+static struct cache_entry *entry_load(int fd, const char *path, unsigned int hash, struct stat *st)
+{
+	struct header h;
+	struct cache_entry *e;
+	char etag[ETAG_LEN];
+	char *body;
+	char *mime;
+	int len;
+	size_t got = 0;
+	ssize_t n;
+
+	body = malloc(st->st_size ? st->st_size : 1);
+	while (got < st->st_size && (n = read(fd, body + got, st->st_size - got)) > 0) got += n;
+	if (got != st->st_size) {
+		free(body);
+		return NULL;
+	}
+
+	header_clear(&h);
+	if ((mime = mime_header((char *) path, &len)) != NULL) header_add(&h, mime, len);
+	header_length(&h, st->st_size);
+	header_add(&h, ACCEPT_RANGES, sizeof(ACCEPT_RANGES) - 1);
+	header_vary(&h, (char *) path);
+	header_date(&h, "Last-Modified", st->st_mtime);
+	etag_format(etag, st);
+	header_etag(&h, etag);
+	e = entry_new(path, hash, st, CACHE_FILE, h.buf, h.len, body, got);
+	e->text = mime_compressible((char *) path);
+	return e;
+}
+
+static void shard_publish(struct shard *s, struct cache_entry *e)
+{
+	__sync_fetch_and_add(&e->refs, 1);
+	pthread_mutex_lock(&s->lock);
+	shard_insert(s, e);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Cache an object built outside the cache, such as a directory listing.
+ * body must come from malloc() and is owned by the entry from here on.
+ * Returns a referenced entry.
+ */
+struct cache_entry *cache_put(const char *path, struct stat *st, int type, char *header, int header_len,
+	char *body, size_t len)
+{
+	unsigned int hash = path_hash(path);
+	struct cache_entry *e = entry_new(path, hash, st, type, header, header_len, body, len);
+
+	shard_publish(&shards[hash % CACHE_SHARDS], e);
+	return e;
+}
+
+static struct load *load_find(struct shard *s, const char *key, unsigned int hash)
+{
+	struct load *l;
+
+	for (l = s->loading; l; l = l->next)
+		if (l->hash == hash && strcmp(l->key, key) == 0) return l;
+	return NULL;
+}
+
+static void load_unlink(struct shard *s, struct load *l)
+{
+	struct load **pp = &s->loading;
+
+	while (*pp != l) pp = &(*pp)->next;
+	*pp = l->next;
+}
+
+// Hand a finished load's result to one of its threads and unlock the shard.
+static int load_result(struct shard *s, struct load *l, struct stat *st, struct cache_entry **ep)
+{
+	int r = l->r;
+
+	*st = l->st;
+	if ((*ep = l->e) != NULL) __sync_fetch_and_add(&l->e->refs, 1);
+	if (--l->refs == 0) {
+		if (l->e) cache_release(l->e);
+		free(l);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return r;
+}
+
+// The disk side of a miss, with cache_get()'s results.
+static int load_file(const char *path, unsigned int hash, struct stat *st, struct cache_entry **ep)
+{
+	int fd;
+
+	*ep = NULL;
+	// large files go to the fd cache, so look before opening
+	if (fstatat(docroot, docroot_rel(path), st, 0) < 0) return -1;
+	if (!S_ISREG(st->st_mode) || st->st_size > CACHE_MAX_FILE) return 0;
+	if ((fd = openat(docroot, docroot_rel(path), O_RDONLY | O_CLOEXEC)) < 0) return 0;
+	if (fstat(fd, st) == 0 && S_ISREG(st->st_mode) && st->st_size <= CACHE_MAX_FILE)
+		*ep = entry_load(fd, path, hash, st);
+	close(fd);
+	return 0;
+}
+
+/*
+ * Find path in the cache, loading it on a miss. Returns -1 if the file
+ * does not exist. Otherwise *ep is a referenced entry to be handed back
+ * with cache_release(), or NULL when the file is not cacheable (too large,
+ * unreadable, a directory nobody has cache_put() yet) and *st holds its
+ * stat() result. A fresh hit touches neither the file system nor *st.
+ * Concurrent misses on one path share a single load.
+ */
+int cache_get(const char *path, struct stat *st, struct cache_entry **ep)
+{
+	unsigned int hash = path_hash(path);
+	struct shard *s = &shards[hash % CACHE_SHARDS];
+	struct cache_entry *e;
+	struct load *l;
+	time_t now = time(NULL);
+
+	*ep = NULL;
+	pthread_mutex_lock(&s->lock);
+	if ((e = shard_find(s, path, hash)) != NULL) {
+		if (now - e->checked >= CACHE_REVALIDATE) {
+			int r;
+
+			pthread_mutex_unlock(&s->lock);
+			r = fstatat(docroot, docroot_rel(path), st, 0);
+			pthread_mutex_lock(&s->lock);
+			// the entry may have been evicted while we were off the lock
+			if ((e = shard_find(s, path, hash)) != NULL) {
+				if (r == 0 && (st->st_mode & S_IFMT) == e->mode && e->ino == st->st_ino && e->size == st->st_size
+						&& e->mtime == st->st_mtime && e->mtime_nsec == st->st_mtim.tv_nsec) {
+					e->checked = now;
+				} else {
+					shard_remove(s, e);
+					e = NULL;
+				}
+			}
+			if (r < 0) {
+				pthread_mutex_unlock(&s->lock);
+				return -1;
+			}
+		}
+		if (e) {
+			lru_unlink(s, e);
+			lru_push(s, e);
+			__sync_fetch_and_add(&e->refs, 1);
+			pthread_mutex_unlock(&s->lock);
+			metrics_inc(cache_hits);
+			*ep = e;
+			return 0;
+		}
+	}
+	if ((l = load_find(s, path, hash)) != NULL) {
+		l->refs++;
+		metrics_inc(cache_coalesced);
+		while (!l->done) pthread_cond_wait(&s->loaded, &s->lock);
+		return load_result(s, l, st, ep);
+	}
+	l = calloc(1, sizeof(*l));
+	l->key = path;
+	l->hash = hash;
+	l->refs = 1;
+	l->next = s->loading;
+	s->loading = l;
+	pthread_mutex_unlock(&s->lock);
+
+	metrics_inc(cache_misses);
+	l->r = load_file(path, hash, &l->st, &l->e);
+
+	pthread_mutex_lock(&s->lock);
+	if (l->e) {
+		__sync_fetch_and_add(&l->e->refs, 1);
+		shard_insert(s, l->e);
+	}
+	load_unlink(s, l);
+	l->done = 1;
+	pthread_cond_broadcast(&s->loaded);
+	return load_result(s, l, st, ep);
+}
+
+/*
+ * Build the enc coded copy of e. A sidecar file (path.br, path.gz) no
+ * older than the file itself is taken as is, so assets can be compressed
+ * offline at the highest settings; otherwise the body is compressed here.
+ */
+static struct cache_variant *variant_build(struct cache_entry *e, int enc)
+{
+	struct cache_variant *v = calloc(1, sizeof(*v));
+	char path[4096];
+	struct header h;
+	struct stat st;
+	char *mime;
+	int fd, len;
+	size_t got = 0;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s.%s", e->key, enc == ENC_BR ? "br" : "gz");
+	if ((fd = openat(docroot, docroot_rel(path), O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= e->mtime && st.st_size <= CACHE_MAX_FILE) {
+			v->body = malloc(st.st_size ? st.st_size : 1);
+			while (got < st.st_size && (n = read(fd, v->body + got, st.st_size - got)) > 0) got += n;
+			v->len = got;
+			if (got != st.st_size) {
+				free(v->body);
+				v->body = NULL;
+			}
+		}
+		close(fd);
+	}
+	if (v->body == NULL) v->body = compress_body(enc, e->body, e->len, &v->len);
+	if (v->body && v->len >= e->len) {
+		free(v->body);
+		v->body = NULL;
+	}
+	if (v->body == NULL) return v;
+
+	snprintf(v->etag, sizeof(v->etag), "%.*s-%s\"", (int) strlen(e->etag) - 1, e->etag, enc_names[enc]);
+	header_clear(&h);
+	if ((mime = mime_header(e->key, &len)) != NULL) header_add(&h, mime, len);
+	header_add(&h, "Content-Encoding: ", 18);
+	header_line(&h, enc_names[enc]);
+	header_length(&h, v->len);
+	header_add(&h, VARY_ENCODING, sizeof(VARY_ENCODING) - 1);
+	header_date(&h, "Last-Modified", e->mtime);
+	header_etag(&h, v->etag);
+	v->header = malloc(h.len);
+	memcpy(v->header, h.buf, h.len);
+	v->header_len = h.len;
+	return v;
+}
+
+/*
+ * The best coded copy of file entry e among the codings in accept (a bit
+ * per ENC_*), or NULL to send it as is. Copies are built on first use;
+ * if two threads race, the loser's copy is thrown away.
+ */
+struct cache_variant *cache_variant(struct cache_entry *e, int accept)
+{
+	struct shard *s = &shards[e->hash % CACHE_SHARDS];
+	struct cache_variant *v, *old;
+	int enc;
+
+	if (!e->text || e->type != CACHE_FILE) return NULL;
+	for (enc = 0; enc < ENC_COUNT; enc++) {
+		if (!(accept & (1 << enc))) continue;
+		if ((v = __atomic_load_n(&e->enc[enc], __ATOMIC_ACQUIRE)) == NULL) {
+			v = variant_build(e, enc);
+			old = NULL;
+			if (!__atomic_compare_exchange_n(&e->enc[enc], &old, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				variant_free(v);
+				v = old;
+			} else if (v->body) {
+				// charge the copy to the shard, unless e has been dropped from it meanwhile
+				pthread_mutex_lock(&s->lock);
+				if (shard_find(s, e->key, e->hash) == e) {
+					e->extra += v->len;
+					s->bytes += v->len;
+				}
+				pthread_mutex_unlock(&s->lock);
+			}
+		}
+		if (v->body) return v;
+	}
+	return NULL;
+}
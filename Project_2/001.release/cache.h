@@ -0,0 +1,67 @@
+#ifndef __CACHE
+#define __CACHE
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "header.h"
+#include "compress.h"
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256 // hash chains per shard
+#define CACHE_MAX_BYTES (64 << 20) // body bytes held over all shards
+#define CACHE_MAX_FILE (1 << 20) // larger files are streamed from disk
+#define CACHE_REVALIDATE 1 // seconds an entry is trusted before it is stat()ed again
+
+enum { CACHE_FILE, CACHE_LISTING, CACHE_INDEX };
+
+/*
+ * A compressed copy of a cached text file. One whose body is NULL records
+ * that the coding did not pay off, so it is not tried again.
+ */
+struct cache_variant {
+	char *header; // as cache_entry.header, plus Content-Encoding
+	int header_len;
+	char *body;
+	size_t len;
+	char etag[ETAG_LEN];
+};
+
+/*
+ * Besides file bodies the cache holds rendered directory listings and,
+ * for directories that have an index.html, a body-less CACHE_INDEX marker
+ * so the index probe is not repeated. Directory entries are validated
+ * against the directory's own mtime, which changes when entries are
+ * added, removed or renamed.
+ */
+struct cache_entry {
+	char *key;
+	int type;
+	unsigned int hash;
+	char *header; // Content-Type/Length and Last-Modified lines
+	int header_len;
+	char *body;
+	size_t len;
+	mode_t mode; // S_IFMT bits of the cached object
+	time_t mtime;
+	long mtime_nsec; // st_mtim to the nanosecond, so a same-second rewrite is noticed
+	ino_t ino; // ... and a new file renamed over the old one
+	off_t size;
+	char etag[ETAG_LEN];
+	int text; // a type worth compressing
+	struct cache_variant *enc[ENC_COUNT]; // built on first request, freed with the entry
+	size_t extra; // bytes held by the variants
+	time_t checked; // when the entry was last compared with the file
+	int refs;
+	struct cache_entry *hnext;
+	struct cache_entry *prev, *next; // LRU list, most recent first
+};
+
+void cache_init();
+int cache_get(const char *path, struct stat *st, struct cache_entry **ep);
+struct cache_entry *cache_put(const char *path, struct stat *st, int type, char *header, int header_len,
+	char *body, size_t len);
+void cache_release(struct cache_entry *e);
+struct cache_variant *cache_variant(struct cache_entry *e, int accept);
+
+#endif
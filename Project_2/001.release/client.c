@@ -1,205 +1,747 @@
 #include <stdio.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <stdlib.h>
-#include <netdb.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "hdr.h"
+#include "scenario.h"
 
-int create_tcp_socket();
-char *get_ip(char *host);
-char *build_get_query(char *host, char *page);
-void usage();
-void *client(void *arg);
-int timeval_subtract(struct timeval *result, struct timeval *t2, struct timeval *t1);
-
-#define HOST "coding.debuntu.org"
-#define PAGE "/"
 #define USERAGENT "HTMLGET 1.0"
+#define PAGE "/"
+#define MAX_THREAD 64
+#define HEAD_MAX 8192 // response header bytes kept for parsing
+#define READ_BUF 65536
+#define EVENTS 256
+
+/*
+ * Open-loop load generator. Request i is due at start + i / rate no
+ * matter how the earlier ones fared, and its latency is measured from
+ * that moment. A server that stalls therefore shows up in the
+ * percentiles as the queue of requests it held up, instead of slowing
+ * the client down and hiding (coordinated omission). Time from the
+ * request actually going out is reported separately as service time.
+ *
+ * Each thread runs its own epoll loop with its share of the rate and of
+ * the connections. Connections are opened as they are needed and kept
+ * alive between requests; a request that finds every connection busy
+ * waits for one, still on the clock.
+ *
+ * What is requested and how fast comes from the scenario: by default one
+ * page at a constant rate, with -s a URL mix and a schedule of phases,
+ * with -R the requests of an access log.
+ */
+enum { C_CLOSED, C_CONNECTING, C_IDLE, C_WRITING, C_READING };
+enum { B_NONE, B_LENGTH, B_CHUNK_SIZE, B_CHUNK_DATA, B_CHUNK_END, B_TRAILER, B_EOF };
+
+struct client_conn {
+	int fd;
+	int state;
+	int events; // what epoll waits for on fd
+	int served; // responses received on this connection
+	int retried;
+	int url; // index into scen.urls
+	unsigned long long ready; // ns when its think time is over
+	unsigned long long intended; // ns when the request was due
+	unsigned long long sent; // ns when it was written
+	int req_off; // bytes of the request written so far
+
+	char head[HEAD_MAX];
+	int head_len;
+	int status;
+	int body; // B_*
+	long long left; // body or chunk bytes still to come
+	int close; // the server will close after this response
+	unsigned long rbytes;
 
-#define MAX_THREAD 100
+	struct client_conn *next; // idle or closed list
+};
 
+struct class_stats {
+	unsigned long completed;
+	unsigned long errors;
+	unsigned long bytes;
+	struct hdr *latency;
+};
+
+struct loop {
+	int id;
+	int epfd;
+	int tfd; // wakes the loop when the next request is due, epoll_wait() alone only has ms resolution
+	pthread_t tid;
+	int nconn;
+	struct client_conn *conns;
+	struct client_conn *idle; // nothing in flight, connected unless the server has since closed it
+	struct client_conn *closed;
+	struct client_conn **thinking; // heap on ready
+	int nthinking;
+	unsigned long long start, end;
+	double next; // seconds after start the next request is due, -1 when there are no more
+	int next_url;
+	int cursor; // replay record the next request comes from
+	unsigned long long rng;
+	int inflight;
+
+	unsigned long completed;
+	unsigned long errors;
+	unsigned long unsent; // came due but no connection freed up before the run ended
+	unsigned long retries;
+	unsigned long connects;
+	unsigned long bytes;
+	unsigned long status[6]; // by class, 1xx to 5xx
+	struct hdr *latency;
+	struct hdr *service;
+	struct class_stats cls[MAX_CLASS];
+};
+
+struct sockaddr_in remote;
 char *host;
-char *page;
+char *page = PAGE;
+char *scenario_file;
+char *replay_file;
+double speed = 1;
+unsigned long long seed = 1;
 int port;
+double rate = 100;
+int duration = 10;
+int nconn = 10;
+int nthread = 1;
+int per_conn = 0; // requests per connection, 0 for as many as the server allows
+int drain = 5;
+int csv; // print one line of comma separated results instead of the report
 
-int main(int argc, char **argv)
+static unsigned long long now_ns()
 {
-	if(argc < 3){
-		usage();
-		exit(2);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void usage()
+{
+	fprintf(stderr, "USAGE: ./client [options] <host> <port> [# connections] [page]\n"
+		"\thost: IP or hostname. ex: 127.0.0.1\n"
+		"\tpage: the page to retrieve. ex: index.html, default: /\n"
+		"options:\n"
+		"\t-r rate      requests per second, sent on schedule however the server keeps up (default %g)\n"
+		"\t-d seconds   how long to send for (default %d)\n"
+		"\t-c n         most connections open at once (default %d)\n"
+		"\t-t n         event loop threads (default %d)\n"
+		"\t-k n         requests per connection before reconnecting, 0 to reuse it as long as\n"
+		"\t             the server allows (default %d)\n"
+		"\t-T seconds   wait this long for responses still due at the end (default %d)\n"
+		"\t-s file      run the scenario in file: URL classes, popularity, think time and\n"
+		"\t             phases, see scenario.c\n"
+		"\t-R file      replay the GETs in an access log, as far apart as they were logged\n"
+		"\t             or, without timestamps, at the -r rate\n"
+		"\t-x factor    replay that many times faster (default 1)\n"
+		"\t-S seed      seed for picking URLs and think times (default %llu)\n"
+		"\t-C           print only completed,failed,unsent,req_s,mb_s,p50_us,p90_us,p99_us,\n"
+		"\t             p999_us,max_us for scripts\n",
+		rate, duration, nconn, nthread, per_conn, drain, seed);
+}
+
+static void conn_shut(struct client_conn *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->state = C_CLOSED;
+	c->served = 0;
+}
+
+static void conn_close(struct loop *l, struct client_conn *c)
+{
+	conn_shut(c);
+	c->next = l->closed;
+	l->closed = c;
+}
+
+static void conn_wait(struct loop *l, struct client_conn *c, int events)
+{
+	struct epoll_event ev;
+
+	if (c->events == events) return;
+	ev.data.ptr = c;
+	ev.events = events;
+	epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->events = events;
+}
+
+static void conn_write(struct loop *l, struct client_conn *c)
+{
+	struct url *u = &scen.urls[c->url];
+	int n;
+
+	while (c->req_off < u->len) {
+		n = send(c->fd, u->request + c->req_off, u->len - c->req_off, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		if (n <= 0) return; // the read side sees the error too
+		c->req_off += n;
 	}
+	conn_wait(l, c, c->req_off < u->len ? EPOLLOUT : EPOLLIN);
+	c->state = c->req_off < u->len ? C_WRITING : C_READING;
+}
+
+// Put the request due at intended on c, connecting it first if need be.
+static void conn_issue(struct loop *l, struct client_conn *c, unsigned long long intended, int url)
+{
+	struct epoll_event ev;
+	int one = 1;
 
-	struct timeval tvBegin, tvEnd, tvDiff;
-	int nthread, failed = 0;
-	int *tret = NULL;
-				
-	if(argc < 3) {
-		printf("usage: ./client [server ip or dns] [port] <# thread>\n");
-		return 0;
+	c->intended = intended;
+	c->url = url;
+	c->req_off = 0;
+	c->head_len = 0;
+	c->body = B_NONE;
+	c->close = 0;
+	c->rbytes = 0;
+	if (c->state == C_CLOSED) {
+		c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		l->connects++;
+		ev.data.ptr = c;
+		ev.events = c->events = EPOLLOUT;
+		epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+		c->sent = now_ns();
+		if (connect(c->fd, (struct sockaddr *) &remote, sizeof(remote)) < 0 && errno != EINPROGRESS) {
+			c->state = C_READING; // reported as a failed request by the event that follows
+			return;
+		}
+		c->state = C_CONNECTING;
+		return;
 	}
-	host = argv[1];
-	port = atoi(argv[2]);
-		
-	if(argc < 4) nthread  = 10;
-	else nthread = atoi(argv[3]);
-	if(nthread > MAX_THREAD) nthread = MAX_THREAD;
-	if(argc > 4){
-		page = argv[4];
-	}else{
-		page = PAGE;
+	c->sent = now_ns();
+	c->state = C_WRITING;
+	conn_write(l, c);
+}
+
+static void request_failed(struct loop *l, struct client_conn *c)
+{
+	unsigned long long intended = c->intended;
+	// a reused connection the server closed before reading our request: try once more
+	int again = c->served > 0 && c->rbytes == 0 && !c->retried;
+
+	conn_close(l, c);
+	if (again) {
+		l->retries++;
+		c = l->closed;
+		l->closed = c->next;
+		c->retried = 1;
+		conn_issue(l, c, intended, c->url);
+		return;
 	}
+	l->errors++;
+	l->cls[scen.urls[c->url].class].errors++;
+	l->inflight--;
+}
 
-	gettimeofday(&tvBegin, NULL);
-	printf("Request: GET %s:%d/%s, # of client: %d\n", host, port, page, nthread);
+// Back on the idle or closed list, whichever fits.
+static void conn_park(struct loop *l, struct client_conn *c)
+{
+	if (c->state == C_CLOSED) {
+		c->next = l->closed;
+		l->closed = c;
+	} else {
+		c->next = l->idle;
+		l->idle = c;
+	}
+}
+
+static void think_push(struct loop *l, struct client_conn *c)
+{
+	int i = l->nthinking++, parent;
 
-	pthread_t *p = (pthread_t*)malloc(nthread * sizeof(pthread_t));
-	int i;
-	for(i = 0; i < nthread; i++)
-	{
-		pthread_create(&(p[i]), NULL, client, NULL);
+	while (i > 0 && l->thinking[parent = (i - 1) / 2]->ready > c->ready) {
+		l->thinking[i] = l->thinking[parent];
+		i = parent;
 	}
+	l->thinking[i] = c;
+}
 
-	for(i = 0; i < nthread; i++)
-	{
-		pthread_join(p[i], (void**)&tret);
-		if((*tret) <= 0) failed++;
+static struct client_conn *think_pop(struct loop *l)
+{
+	struct client_conn *top = l->thinking[0], *last = l->thinking[--l->nthinking];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < l->nthinking) {
+		if (child + 1 < l->nthinking && l->thinking[child + 1]->ready < l->thinking[child]->ready) child++;
+		if (last->ready <= l->thinking[child]->ready) break;
+		l->thinking[i] = l->thinking[child];
+		i = child;
 	}
-	gettimeofday(&tvEnd, NULL);
-	timeval_subtract(&tvDiff, &tvEnd, &tvBegin);
-	printf("Time to handle %d requests (%d failed): %ld.%06ld sec\n", nthread, failed, tvDiff.tv_sec, tvDiff.tv_usec);
+	l->thinking[i] = last;
+	return top;
 }
 
-void *client(void *arg)
+static void request_finished(struct loop *l, struct client_conn *c)
 {
-	struct sockaddr_in *remote;
-	int sock;
-	int tmpres;
-	char *get;
-	char buf[BUFSIZ+1];
-	char **argv = arg;
-	char *ip;
-	struct timeval tvBegin, tvEnd, tvDiff;
-
-	gettimeofday(&tvBegin, NULL);
-	sock = create_tcp_socket();
-	ip = get_ip(host);
-	//fprintf(stderr, "IP is %s:%d\n", ip, port); 
-	remote = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in *));
-	remote->sin_family = AF_INET;
-	tmpres = inet_pton(AF_INET, ip, (void *)(&(remote->sin_addr.s_addr)));
-	if( tmpres < 0)  
-	{
-		perror("Can't set remote->sin_addr.s_addr");
-		exit(1);
-	}else if(tmpres == 0)
-	{
-		fprintf(stderr, "%s is not a valid IP address\n", ip);
-		exit(1);
-	}
-	remote->sin_port = htons(port);
-
-	if(connect(sock, (struct sockaddr *)remote, sizeof(struct sockaddr)) < 0){
-		perror("Could not connect");
-		exit(1);
-	}
-
-	get = build_get_query(host, page);
-	//fprintf(stderr, "Query is:\n<<START>>\n%s<<END>>\n", get);
-
-	//Send the query to the server
-	int sent = 0;
-	while(sent < strlen(get))
-	{ 
-		tmpres = send(sock, get+sent, strlen(get)-sent, 0);
-		if(tmpres == -1){
-			perror("Can't send query");
-			exit(1);
+	unsigned long long now = now_ns();
+	struct class_stats *cs = &l->cls[scen.urls[c->url].class];
+
+	hdr_record(l->latency, (now - c->intended) / 1000);
+	hdr_record(l->service, (now - c->sent) / 1000);
+	hdr_record(cs->latency, (now - c->intended) / 1000);
+	l->completed++;
+	l->bytes += c->rbytes;
+	cs->completed++;
+	cs->bytes += c->rbytes;
+	if (c->status >= 100 && c->status < 600) l->status[c->status / 100]++;
+	l->inflight--;
+	c->served++;
+	c->retried = 0;
+	if (c->close || (per_conn > 0 && c->served >= per_conn)) conn_shut(c);
+	else c->state = C_IDLE;
+	if (scen.think != THINK_NONE) {
+		// the user behind this connection reads the page before asking for the next
+		c->ready = now + scenario_think(&l->rng) * 1000000;
+		think_push(l, c);
+		return;
+	}
+	conn_park(l, c);
+}
+
+// Parse the status line and the headers that say where the body ends.
+static int parse_head(struct client_conn *c)
+{
+	char *line, *end, *p;
+	int http10;
+
+	c->head[c->head_len] = '\0';
+	if (strncmp(c->head, "HTTP/1.", 7) != 0) return -1;
+	http10 = c->head[7] == '0';
+	c->status = atoi(c->head + 9);
+	c->close = http10;
+	c->body = B_EOF;
+	for (line = strstr(c->head, "\r\n") + 2; (end = strstr(line, "\r\n")) != NULL && end != line; line = end + 2) {
+		*end = '\0';
+		if ((p = strchr(line, ':')) == NULL) continue;
+		*p++ = '\0';
+		while (*p == ' ') p++;
+		if (strcasecmp(line, "Content-Length") == 0) {
+			c->body = B_LENGTH;
+			c->left = atoll(p);
+		} else if (strcasecmp(line, "Transfer-Encoding") == 0 && strcasecmp(p, "chunked") == 0) {
+			c->body = B_CHUNK_SIZE;
+			c->left = 0;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			c->close = strcasecmp(p, "close") == 0 || (http10 && strcasecmp(p, "keep-alive") != 0);
 		}
-		sent += tmpres;
-	}
-	//now it is time to receive the page
-	memset(buf, 0, sizeof(buf));
-	int htmlstart = 0;
-	char * htmlcontent;
-	int rbyte = 0;
-	//while((tmpres = recv(sock, buf, BUFSIZ, 0)) > 0)
-	while((tmpres = read(sock, buf, BUFSIZ)) > 0)
-		rbyte += tmpres;
-
-	if(tmpres < 0)
-	{
-		perror("Error receiving data");
-	}
-
-	gettimeofday(&tvEnd, NULL);
-	timeval_subtract(&tvDiff, &tvEnd, &tvBegin);
-	printf("[tid %d] received %d bytes (%ld.%06ld sec).\n", syscall(186), rbyte, tvDiff.tv_sec, tvDiff.tv_usec);
-	free(get);
-	free(remote);
-	free(ip);
-	close(sock);
-	pthread_exit((void*)&rbyte);
+	}
+	if (c->status == 204 || c->status == 304 || c->status / 100 == 1) c->body = B_LENGTH, c->left = 0;
+	if (c->body == B_EOF) c->close = 1;
 	return 0;
 }
 
-void usage()
+/*
+ * Consume n body bytes. Returns 1 once the response is complete. Chunk
+ * sizes are read a digit at a time so they may straddle reads.
+ */
+static int parse_body(struct client_conn *c, char *p, int n)
 {
-	fprintf(stderr, "USAGE: ./client <host> <port> <# thread> [page]\n\
-					\thost: IP or hostname. ex: 127.0.0.1\n\
-					\tpage: the page to retrieve. ex: index.html, default: /\n");
+	char ch;
+
+	while (n > 0 || (c->body == B_LENGTH && c->left == 0)) {
+		switch (c->body) {
+		case B_LENGTH:
+		case B_CHUNK_DATA:
+			if (c->left > n) {
+				c->left -= n;
+				return 0;
+			}
+			p += c->left;
+			n -= c->left;
+			c->left = 0;
+			if (c->body == B_LENGTH) return 1;
+			c->body = B_CHUNK_END;
+			break;
+		case B_EOF:
+			return 0;
+		default:
+			ch = *p++;
+			n--;
+			if (ch != '\n') {
+				if (c->body == B_CHUNK_SIZE && c->left >= 0 && isxdigit(ch))
+					c->left = c->left * 16 + (isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10);
+				else if (c->body == B_CHUNK_SIZE && c->left >= 0 && ch != '\r')
+					c->left = -c->left - 1; // extension: ignore the rest of the line
+				else if (c->body == B_TRAILER && ch != '\r')
+					c->left = 1; // a trailer line, not the final empty one
+				break;
+			}
+			if (c->body == B_CHUNK_SIZE) {
+				if (c->left < 0) c->left = -c->left - 1;
+				c->body = c->left ? B_CHUNK_DATA : B_TRAILER;
+			} else if (c->body == B_CHUNK_END) {
+				c->body = B_CHUNK_SIZE;
+			} else if (c->left == 0) {
+				return 1; // the empty line after the trailers
+			} else {
+				c->left = 0;
+			}
+			break;
+		}
+	}
+	return 0;
 }
 
+static void conn_readable(struct loop *l, struct client_conn *c, char *buf)
+{
+	char *end;
+	int n, take, done = 0;
+
+	while (!done && (n = read(c->fd, buf, READ_BUF)) > 0) {
+		c->rbytes += n;
+		if (c->body == B_NONE) {
+			take = n < HEAD_MAX - 1 - c->head_len ? n : HEAD_MAX - 1 - c->head_len;
+			memcpy(c->head + c->head_len, buf, take);
+			c->head_len += take;
+			c->head[c->head_len] = '\0';
+			if ((end = strstr(c->head, "\r\n\r\n")) == NULL) {
+				if (c->head_len == HEAD_MAX - 1) break;
+				continue;
+			}
+			// the rest of this read is body
+			take -= c->head_len - (end + 4 - c->head);
+			c->head_len = end + 4 - c->head;
+			if (parse_head(c) < 0) break;
+			done = parse_body(c, buf + take, n - take);
+		} else {
+			done = parse_body(c, buf, n);
+		}
+	}
+	if (done) {
+		request_finished(l, c);
+	} else if (n == 0 && c->body == B_EOF) {
+		c->close = 1;
+		request_finished(l, c);
+	} else if (n >= 0 || errno != EAGAIN) {
+		request_failed(l, c);
+	}
+}
 
-int create_tcp_socket()
+static void conn_event(struct loop *l, struct client_conn *c, int events, char *buf)
 {
-	int sock;
-	if((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0){
-		perror("Can't create TCP socket");
-		exit(1);
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	switch (c->state) {
+	case C_IDLE:
+		// the server closed a connection we were keeping alive; it stays where it is, closed
+		conn_shut(c);
+		break;
+	case C_CONNECTING:
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err || (events & (EPOLLERR | EPOLLHUP))) {
+			request_failed(l, c);
+			break;
+		}
+		c->state = C_WRITING;
+		conn_write(l, c);
+		break;
+	case C_WRITING:
+		if (events & (EPOLLERR | EPOLLHUP)) {
+			request_failed(l, c);
+			break;
+		}
+		conn_write(l, c);
+		break;
+	case C_READING:
+		conn_readable(l, c, buf);
+		break;
 	}
-	return sock;
 }
 
-char *get_ip(char *host)
+static struct client_conn *conn_take(struct loop *l)
 {
-	struct hostent *hent;
-	int iplen = 15; //XXX.XXX.XXX.XXX
-	char *ip = (char *)malloc(iplen+1);
-	memset(ip, 0, iplen+1);
-	if((hent = gethostbyname(host)) == NULL)
-	{
-		herror("Can't get IP");
-		exit(1);
+	struct client_conn *c;
+
+	if ((c = l->idle) != NULL) l->idle = c->next;
+	else if ((c = l->closed) != NULL) l->closed = c->next;
+	return c;
+}
+
+// Move on to the request after the one just sent.
+static void schedule(struct loop *l)
+{
+	if (scen.replay) {
+		l->cursor += nthread;
+		l->next = l->cursor < scen.nreplay ? scen.replay[l->cursor].at : -1;
+		if (l->next >= 0) l->next_url = scen.replay[l->cursor].url;
+		return;
+	}
+	// each loop takes every nthread-th request
+	if (l->next >= 0) l->next = scenario_advance(l->next, nthread);
+	l->next_url = scenario_pick(&l->rng);
+}
+
+static unsigned long long due(struct loop *l)
+{
+	return l->start + (unsigned long long) (l->next * 1e9);
+}
+
+void *client(void *arg)
+{
+	struct loop *l = arg;
+	struct epoll_event events[EVENTS];
+	struct client_conn *c;
+	unsigned long long now, next, stop = l->end + drain * 1000000000ULL;
+	char *buf = malloc(READ_BUF);
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	unsigned long long ticks;
+	int i, n;
+
+	l->epfd = epoll_create1(0);
+	l->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->tfd, &ev);
+	l->thinking = malloc(l->nconn * sizeof(struct client_conn *));
+	for (i = l->nconn - 1; i >= 0; i--) {
+		l->conns[i].fd = -1;
+		l->conns[i].state = C_CLOSED;
+		l->conns[i].next = l->closed;
+		l->closed = &l->conns[i];
+	}
+	for (i = 0; i < scen.nclasses; i++) l->cls[i].latency = hdr_new();
+
+	// loop i starts at request i, its share interleaves with the other loops'
+	if (scen.replay) {
+		l->cursor = l->id - nthread;
+		schedule(l);
+	} else {
+		l->next = scenario_advance(0, l->id + 1);
+		l->next_url = scenario_pick(&l->rng);
+	}
+
+	while (1) {
+		now = now_ns();
+		while (l->nthinking > 0 && l->thinking[0]->ready <= now) conn_park(l, think_pop(l));
+		while (l->next >= 0 && due(l) <= now && (c = conn_take(l)) != NULL) {
+			conn_issue(l, c, due(l), l->next_url);
+			l->inflight++;
+			schedule(l);
+		}
+		if ((l->next < 0 && l->inflight == 0) || now >= stop) break;
+
+		// with requests waiting for a connection the next event is what matters
+		next = stop;
+		if (l->next >= 0 && due(l) > now) next = due(l);
+		if (l->nthinking > 0 && l->thinking[0]->ready < next) next = l->thinking[0]->ready;
+		its.it_value.tv_sec = next / 1000000000;
+		its.it_value.tv_nsec = next % 1000000000;
+		timerfd_settime(l->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+		n = epoll_wait(l->epfd, events, EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL) read(l->tfd, &ticks, sizeof(ticks));
+			else conn_event(l, events[i].data.ptr, events[i].events, buf);
+		}
 	}
-	if(inet_ntop(AF_INET, (void *)hent->h_addr_list[0], ip, iplen) == NULL)
-	{
-		perror("Can't resolve host");
-		exit(1);
+
+	// what is still outstanding never got an answer, what is left never went out
+	l->errors += l->inflight;
+	for (; l->next >= 0; schedule(l)) l->unsent++;
+	for (i = 0; i < l->nconn; i++) {
+		c = &l->conns[i];
+		if (c->state == C_CONNECTING || c->state == C_WRITING || c->state == C_READING)
+			l->cls[scen.urls[c->url].class].errors++;
+		if (c->fd >= 0) close(c->fd);
 	}
-	return ip;
+	close(l->tfd);
+	close(l->epfd);
+	free(l->thinking);
+	free(buf);
+	return NULL;
 }
 
-char *build_get_query(char *host, char *page)
+static int resolve(char *host)
 {
-	char *query;
-	char *getpage = page;
-	char *tpl = "GET /%s HTTP/1.0\r\nHost: %s\r\nUser-Agent: %s\r\n\r\n";
-	if(getpage[0] == '/'){
-		getpage = getpage + 1;
-		//fprintf(stderr,"Removing leading \"/\", converting %s to %s\n", page, getpage);
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+	int err;
+
+	if ((err = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+		fprintf(stderr, "Can't get IP for %s: %s\n", host, gai_strerror(err));
+		return -1;
 	}
-	// -5 is to consider the %s %s %s in tpl and the ending \0
-	query = (char *)malloc(strlen(host)+strlen(getpage)+strlen(USERAGENT)+strlen(tpl)-5);
-	sprintf(query, tpl, getpage, host, USERAGENT);
-	return query;
+	remote = *(struct sockaddr_in *) res->ai_addr;
+	remote.sin_port = htons(port);
+	freeaddrinfo(res);
+	return 0;
 }
 
-int timeval_subtract(struct timeval *result, struct timeval *t2, struct timeval *t1)
+static void class_print(FILE *f, char *name, struct class_stats *cs, double secs)
 {
-	long int diff = (t2->tv_usec + 1000000 * t2->tv_sec) - (t1->tv_usec + 1000000 * t1->tv_sec);
-	result->tv_sec = diff / 1000000;
-	result->tv_usec = diff % 1000000;
-	return (diff<0);
+	char p50[32], p99[32], p999[32], max[32];
+
+	hdr_format(p50, sizeof(p50), hdr_percentile(cs->latency, 50));
+	hdr_format(p99, sizeof(p99), hdr_percentile(cs->latency, 99));
+	hdr_format(p999, sizeof(p999), hdr_percentile(cs->latency, 99.9));
+	hdr_format(max, sizeof(max), cs->latency->max);
+	fprintf(f, "%-12s %9lu %7lu %9.1f %8.2f %10s %10s %10s %10s\n", name, cs->completed, cs->errors,
+		cs->completed / secs, cs->bytes / secs / 1e6, p50, p99, p999, max);
 }
 
+int main(int argc, char **argv)
+{
+	struct loop *loops;
+	struct rlimit rl;
+	struct hdr *latency = hdr_new(), *service = hdr_new();
+	struct class_stats cls[MAX_CLASS];
+	unsigned long completed = 0, errors = 0, unsent = 0, retries = 0, connects = 0, bytes = 0, status[6] = { 0 };
+	unsigned long long start, elapsed;
+	double secs;
+	int opt, i, j;
+
+	while ((opt = getopt(argc, argv, "r:d:c:t:k:T:s:R:x:S:C")) != -1) {
+		switch (opt) {
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'c':
+			nconn = atoi(optarg);
+			break;
+		case 't':
+			nthread = atoi(optarg);
+			break;
+		case 'k':
+			per_conn = atoi(optarg);
+			break;
+		case 'T':
+			drain = atoi(optarg);
+			break;
+		case 's':
+			scenario_file = optarg;
+			break;
+		case 'R':
+			replay_file = optarg;
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			csv = 1;
+			break;
+		default:
+			usage();
+			exit(2);
+		}
+	}
+	if (argc - optind < 2) {
+		usage();
+		exit(2);
+	}
+	host = argv[optind];
+	port = atoi(argv[optind + 1]);
+	if (argc - optind > 2) nconn = atoi(argv[optind + 2]);
+	if (argc - optind > 3) page = argv[optind + 3];
+	if (rate <= 0 || duration <= 0 || nconn <= 0 || speed <= 0) {
+		usage();
+		exit(2);
+	}
+	if (nthread < 1) nthread = 1;
+	if (nthread > MAX_THREAD) nthread = MAX_THREAD;
+	if (nthread > nconn) nthread = nconn;
+	if (resolve(host) < 0) exit(1);
+	if (replay_file) {
+		if (replay_load(replay_file, speed, rate) < 0) exit(1);
+	} else if (scenario_file) {
+		if (scenario_load(scenario_file) < 0) exit(1);
+	} else {
+		scenario_default(page, rate, duration);
+	}
+	scenario_finish(host, USERAGENT);
+
+	// every connection is a descriptor
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < nconn + 64) {
+		rl.rlim_cur = rl.rlim_max < nconn + 64 ? rl.rlim_max : nconn + 64;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur < nconn + 64) fprintf(stderr, "only %lu descriptors allowed, connections will fail\n",
+			(unsigned long) rl.rlim_cur);
+	}
+
+	if (!csv && (scenario_file || replay_file)) {
+		printf("Request: %s:%d, %s %s over at most %d connections, %d thread%s\n", host, port,
+			replay_file ? "replaying" : "scenario", replay_file ? replay_file : scenario_file,
+			nconn, nthread, nthread > 1 ? "s" : "");
+		scenario_print(stdout);
+	} else if (!csv) {
+		printf("Request: GET %s:%d%s%s, %g req/s for %d s over at most %d connections, %d thread%s\n",
+			host, port, page[0] == '/' ? "" : "/", page, rate, duration, nconn, nthread, nthread > 1 ? "s" : "");
+	}
+
+	loops = calloc(nthread, sizeof(*loops));
+	memset(cls, 0, sizeof(cls));
+	for (j = 0; j < scen.nclasses; j++) cls[j].latency = hdr_new();
+	start = now_ns() + 10000000; // let every thread get going before the first request is due
+	for (i = 0; i < nthread; i++) {
+		loops[i].id = i;
+		loops[i].nconn = nconn / nthread + (i < nconn % nthread);
+		loops[i].conns = calloc(loops[i].nconn, sizeof(struct client_conn));
+		loops[i].start = start;
+		loops[i].end = start + (unsigned long long) (scen.seconds * 1e9);
+		loops[i].rng = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+		loops[i].latency = hdr_new();
+		loops[i].service = hdr_new();
+		pthread_create(&loops[i].tid, NULL, client, &loops[i]);
+	}
+	for (i = 0; i < nthread; i++) {
+		pthread_join(loops[i].tid, NULL);
+		completed += loops[i].completed;
+		errors += loops[i].errors;
+		unsent += loops[i].unsent;
+		retries += loops[i].retries;
+		connects += loops[i].connects;
+		bytes += loops[i].bytes;
+		for (j = 0; j < 6; j++) status[j] += loops[i].status[j];
+		hdr_merge(latency, loops[i].latency);
+		hdr_merge(service, loops[i].service);
+		for (j = 0; j < scen.nclasses; j++) {
+			cls[j].completed += loops[i].cls[j].completed;
+			cls[j].errors += loops[i].cls[j].errors;
+			cls[j].bytes += loops[i].cls[j].bytes;
+			hdr_merge(cls[j].latency, loops[i].cls[j].latency);
+		}
+	}
+	elapsed = now_ns() - start;
+	secs = elapsed / 1e9;
+
+	if (csv) {
+		printf("%lu,%lu,%lu,%.1f,%.3f,%lu,%lu,%lu,%lu,%lu\n", completed, errors, unsent, completed / secs,
+			bytes / secs / 1e6, hdr_percentile(latency, 50), hdr_percentile(latency, 90),
+			hdr_percentile(latency, 99), hdr_percentile(latency, 99.9), latency->max);
+		return errors + unsent > 0;
+	}
+	printf("requests:    %lu completed, %lu failed, %lu never sent, %lu retried on a new connection\n",
+		completed, errors, unsent, retries);
+	printf("status:      %lu 2xx, %lu 3xx, %lu 4xx, %lu 5xx\n", status[2], status[3], status[4], status[5]);
+	printf("throughput:  %.1f req/s, %.2f MB/s over %.2f s\n", completed / secs, bytes / secs / 1e6, secs);
+	printf("connections: %lu opened, %.1f requests each\n", connects, connects ? (double) completed / connects : 0.0);
+	hdr_print(stdout, "latency:", latency);
+	hdr_print(stdout, "service:", service);
+	if (scen.nclasses > 1) {
+		printf("\n%-12s %9s %7s %9s %8s %10s %10s %10s %10s\n", "class", "requests", "failed", "req/s", "MB/s",
+			"p50", "p99", "p99.9", "max");
+		for (j = 0; j < scen.nclasses; j++) class_print(stdout, scen.classes[j].name, &cls[j], secs);
+	}
+	return errors + unsent > 0;
+}
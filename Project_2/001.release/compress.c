@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#include "compress.h"
+
+const char *enc_names[ENC_COUNT] = { "br", "gzip" };
+
+static char *gzip_body(const char *in, size_t len, size_t *out_len)
+{
+	z_stream z = { 0 };
+	char *out;
+
+	// 16 added to the window bits asks for a gzip wrapper instead of zlib's
+	if (deflateInit2(&z, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+	out = malloc(deflateBound(&z, len));
+	z.next_in = (unsigned char *) in;
+	z.avail_in = len;
+	z.next_out = (unsigned char *) out;
+	z.avail_out = deflateBound(&z, len);
+	if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		free(out);
+		return NULL;
+	}
+	*out_len = z.total_out;
+	deflateEnd(&z);
+	return out;
+}
+
+#ifdef HAVE_BROTLI
+static char *brotli_body(const char *in, size_t len, size_t *out_len)
+{
+	size_t size = BrotliEncoderMaxCompressedSize(len);
+	char *out;
+
+	if (size == 0) return NULL;
+	out = malloc(size);
+	*out_len = size;
+	if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len,
+			(const uint8_t *) in, out_len, (uint8_t *) out)) {
+		free(out);
+		return NULL;
+	}
+	return out;
+}
+#else
+// built without libbrotlienc: br copies only come from .br sidecar files
+static char *brotli_body(const char *in, size_t len, size_t *out_len)
+{
+	return NULL;
+}
+#endif
+
+// Compress a whole body in one go. Returns a malloc()ed buffer, or NULL on failure.
+char *compress_body(int enc, const char *in, size_t len, size_t *out_len)
+{
+	if (enc == ENC_BR) return brotli_body(in, len, out_len);
+	return gzip_body(in, len, out_len);
+}
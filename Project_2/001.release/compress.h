@@ -0,0 +1,16 @@
+#ifndef __COMPRESS
+#define __COMPRESS
+
+#include <stddef.h>
+
+#define GZIP_LEVEL 6
+#define BROTLI_QUALITY 9 // done once per cached file, so spend more than a streaming encoder would
+
+// Content codings, in order of preference.
+enum { ENC_BR, ENC_GZIP, ENC_COUNT };
+
+extern const char *enc_names[ENC_COUNT];
+
+char *compress_body(int enc, const char *in, size_t len, size_t *out_len);
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "config.h"
+#include "webserver.h"
+
+struct config conf = {
+	.backlog = 1024,
+	.listeners = 0,
+	.defer_accept = 10,
+	.processes = 0,
+	.max_queue = 0,
+	.max_wait = 0,
+	.min_threads = 1,
+	.max_threads = 0,
+	.reserve = 0,
+	.affinity = 0,
+	.rate = 0,
+	.client_rate = 0,
+	.conn_rate = 0,
+	.pack = NULL,
+	.trace = NULL,
+};
+
+void config_usage()
+{
+	fprintf(stderr, "options:\n"
+		"\t-b backlog   listen backlog (default %d)\n"
+		"\t-l n         open n SO_REUSEPORT listeners; webserver only sets SO_REUSEPORT\n"
+		"\t             so that one instance per core can share PORT\n"
+		"\t-d seconds   TCP_DEFER_ACCEPT: wake accept only once data has arrived\n"
+		"\t             (default %d, 0 to accept on SYN/ACK)\n"
+		"\t-p n         webserver_multi: pre-fork n processes with a thread pool each,\n"
+		"\t             respawning any that die\n"
+		"\t-c percent   chance that a connection kills the thread it is handed to\n"
+		"\t-q n         webserver_multi: answer 503 right away while n connections are queued\n"
+		"\t-w ms        webserver_multi: answer 503 while the oldest queued connection\n"
+		"\t             has waited longer than ms\n"
+		"\t-m n, -M n   webserver_multi: let the pool grow and shrink between n and n threads,\n"
+		"\t             starting from #_of_threads\n"
+		"\t-r n         webserver_multi: never let large transfers occupy the last n workers\n"
+		"\t-a           webserver_multi: split the threads into a pool per CPU, pinned to it,\n"
+		"\t             and serve each connection on the CPU its packets arrive on\n"
+		"\t-g rate      send bodies streamed from disk at no more than rate bytes/s in all\n"
+		"\t             (k, m and g suffixes multiply by 1024)\n"
+		"\t-i rate      ... at no more than rate to any one client address\n"
+		"\t-s rate      ... at no more than rate on any one connection\n"
+		"\t-P file      serve the pack built by mkpack instead of the current directory\n"
+		"\t-t file      trace request phases and write them to file at shutdown in Chrome\n"
+		"\t             trace format (file.PID with -p)\n",
+		conf.backlog, conf.defer_accept);
+}
+
+static long rate_parse(char *s)
+{
+	char *end;
+	long r = strtol(s, &end, 10);
+
+	switch (*end) {
+	case 'g': case 'G': r *= 1024; // fall through
+	case 'm': case 'M': r *= 1024; // fall through
+	case 'k': case 'K': r *= 1024;
+	}
+	return r > 0 ? r : 0;
+}
+
+// Returns the index of the first positional argument, or -1 on a bad option.
+int config_parse(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:l:d:p:c:q:w:m:M:r:t:P:ag:i:s:")) != -1) {
+		switch (opt) {
+		case 'b':
+			conf.backlog = atoi(optarg);
+			break;
+		case 'l':
+			conf.listeners = atoi(optarg);
+			if (conf.listeners > MAX_LISTENER) conf.listeners = MAX_LISTENER;
+			break;
+		case 'd':
+			conf.defer_accept = atoi(optarg);
+			break;
+		case 'p':
+			conf.processes = atoi(optarg);
+			break;
+		case 'c':
+			CRASH = atoi(optarg);
+			break;
+		case 'q':
+			conf.max_queue = atoi(optarg);
+			break;
+		case 'w':
+			conf.max_wait = atoi(optarg);
+			break;
+		case 'm':
+			conf.min_threads = atoi(optarg);
+			break;
+		case 'M':
+			conf.max_threads = atoi(optarg);
+			break;
+		case 'r':
+			conf.reserve = atoi(optarg);
+			break;
+		case 'P':
+			conf.pack = optarg;
+			break;
+		case 'a':
+			conf.affinity = 1;
+			break;
+		case 'g':
+			conf.rate = rate_parse(optarg);
+			break;
+		case 'i':
+			conf.client_rate = rate_parse(optarg);
+			break;
+		case 's':
+			conf.conn_rate = rate_parse(optarg);
+			break;
+		case 't':
+			conf.trace = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return optind;
+}
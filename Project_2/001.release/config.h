@@ -0,0 +1,33 @@
+#ifndef __CONFIG
+#define __CONFIG
+
+#define MAX_LISTENER 64
+
+/*
+ * Tunables shared by webserver and webserver_multi, set from command
+ * line options that may appear anywhere among the positional arguments.
+ */
+struct config {
+	int backlog; // listen() backlog
+	int listeners; // SO_REUSEPORT listening sockets, 0 for one plain socket
+	int defer_accept; // TCP_DEFER_ACCEPT seconds, 0 to accept on SYN/ACK
+	int processes; // webserver_multi: pre-forked worker processes, 0 to serve from one process
+	int max_queue; // webserver_multi: shed new connections once this many are queued, 0 for no limit
+	int max_wait; // webserver_multi: shed once the oldest queued connection has waited this many ms
+	int min_threads; // webserver_multi: autoscaling bounds for the pool, max_threads 0 for a fixed pool
+	int max_threads;
+	int reserve; // webserver_multi: workers kept free of half-sent large bodies
+	int affinity; // webserver_multi: a queue, listener and workers pinned to each CPU
+	long rate; // bytes/s all streamed bodies together may be sent at, 0 for no limit
+	long client_rate; // ... all bodies to one client address
+	long conn_rate; // ... the body on one connection
+	char *pack; // serve this pack (see mkpack) instead of the current directory, NULL for none
+	char *trace; // write a Chrome trace of request phases here at shutdown, NULL for no tracing
+};
+
+extern struct config conf;
+
+int config_parse(int argc, char *argv[]);
+void config_usage();
+
+#endif
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "docroot.h"
+
+int docroot = -1;
+
+static struct fd_entry *buckets[FD_CACHE_BUCKETS];
+static struct fd_entry *head, *tail;
+static int count;
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int docroot_init(const char *dir)
+{
+	if ((docroot = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		perror("Failed to open document root");
+		return -1;
+	}
+	return 0;
+}
+
+static int hex(char ch)
+{
+	if (ch >= '0' && ch <= '9') return ch - '0';
+	if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Decode a request target into out as "/seg/seg[/]": %XX escapes are
+ * decoded, the query is dropped, and empty and "." segments are removed
+ * along with each ".." and the segment before it, so the result can never
+ * name anything above the document root. Returns -1 for a target that is
+ * not a path, contains %00 or a bad escape, or climbs above the root.
+ */
+int path_normalize(const char *url, char *out, int size)
+{
+	char *end = out + size - 2; // room for a trailing slash and the terminator
+	char *o = out;
+	char *seg;
+	int hi, lo, n, dir = 1;
+
+	if (*url != '/') return -1;
+	while (*url && *url != '?' && *url != '#') {
+		if (*url == '/') {
+			url++;
+			dir = 1;
+			continue;
+		}
+
+		// decode one segment onto the end of out
+		if (o >= end) return -1;
+		*o++ = '/';
+		seg = o;
+		while (*url && *url != '/' && *url != '?' && *url != '#') {
+			if (*url == '%') {
+				if ((hi = hex(url[1])) < 0 || (lo = hex(url[2])) < 0 || (hi | lo) == 0) return -1;
+				if (hi * 16 + lo == '/') return -1; // an escaped slash would smuggle in a segment
+				*o = hi * 16 + lo;
+				url += 3;
+			} else {
+				*o = *url++;
+			}
+			if (++o >= end) return -1;
+		}
+
+		n = o - seg;
+		dir = 0;
+		if (n == 1 && seg[0] == '.') {
+			o = seg - 1;
+			dir = 1;
+		} else if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+			o = seg - 1;
+			if (o == out) return -1;
+			while (o > out && *--o != '/');
+			dir = 1;
+		}
+	}
+	if (dir) *o++ = '/';
+	*o = '\0';
+	return 0;
+}
+
+static void lru_unlink(struct fd_entry *f)
+{
+	if (f->prev) f->prev->next = f->next; else head = f->next;
+	if (f->next) f->next->prev = f->prev; else tail = f->prev;
+	f->prev = f->next = NULL;
+}
+
+static void lru_push(struct fd_entry *f)
+{
+	f->prev = NULL;
+	f->next = head;
+	if (head) head->prev = f; else tail = f;
+	head = f;
+}
+
+static void entry_put(struct fd_entry *f)
+{
+	if (__sync_sub_and_fetch(&f->refs, 1) == 0) {
+		close(f->fd);
+		free(f->key);
+		free(f);
+	}
+}
+
+// Called with fd_lock held.
+static void entry_remove(struct fd_entry *f)
+{
+	struct fd_entry **pp = &buckets[f->hash % FD_CACHE_BUCKETS];
+
+	while (*pp && *pp != f) pp = &(*pp)->hnext;
+	if (*pp) *pp = f->hnext;
+	lru_unlink(f);
+	count--;
+	entry_put(f);
+}
+
+/*
+ * Return a referenced descriptor for the regular file at path, which the
+ * caller has just stat()ed into *st; an entry whose inode, mtime or size
+ * no longer match is replaced, so no extra stat() is needed to validate
+ * it. Returns NULL if the file cannot be opened.
+ */
+struct fd_entry *fd_get(const char *path, struct stat *st)
+{
+	unsigned int hash = path_hash(path);
+	struct fd_entry *f, *old;
+	struct stat now;
+	int fd;
+
+	pthread_mutex_lock(&fd_lock);
+	for (f = buckets[hash % FD_CACHE_BUCKETS]; f; f = f->hnext)
+		if (f->hash == hash && strcmp(f->key, path) == 0) break;
+	if (f && f->ino == st->st_ino && f->mtime == st->st_mtime && f->mtime_nsec == st->st_mtim.tv_nsec
+			&& f->size == st->st_size) {
+		lru_unlink(f);
+		lru_push(f);
+		__sync_fetch_and_add(&f->refs, 1);
+		pthread_mutex_unlock(&fd_lock);
+		metrics_inc(fd_hits);
+		return f;
+	}
+	if (f) entry_remove(f);
+	pthread_mutex_unlock(&fd_lock);
+
+	metrics_inc(fd_misses);
+	if ((fd = openat(docroot, docroot_rel(path), O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+	if (fstat(fd, &now) < 0 || !S_ISREG(now.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+	*st = now;
+
+	f = calloc(1, sizeof(*f));
+	f->key = strdup(path);
+	f->hash = hash;
+	f->fd = fd;
+	f->ino = now.st_ino;
+	f->mtime = now.st_mtime;
+	f->mtime_nsec = now.st_mtim.tv_nsec;
+	f->size = now.st_size;
+	f->refs = 2; // the cache's and the caller's
+
+	pthread_mutex_lock(&fd_lock);
+	// another thread may have opened the same file meanwhile
+	for (old = buckets[hash % FD_CACHE_BUCKETS]; old; old = old->hnext)
+		if (old->hash == hash && strcmp(old->key, path) == 0) break;
+	if (old) entry_remove(old);
+	while (count >= FD_CACHE_MAX && tail) entry_remove(tail);
+	f->hnext = buckets[hash % FD_CACHE_BUCKETS];
+	buckets[hash % FD_CACHE_BUCKETS] = f;
+	lru_push(f);
+	count++;
+	pthread_mutex_unlock(&fd_lock);
+	return f;
+}
+
+void fd_release(struct fd_entry *f)
+{
+	entry_put(f);
+}
@@ -0,0 +1,60 @@
+#ifndef __DOCROOT
+#define __DOCROOT
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FD_CACHE_MAX 256 // open files kept for streaming, well below RLIMIT_NOFILE
+#define FD_CACHE_BUCKETS 64
+
+/*
+ * Files are served relative to the document root, opened once at
+ * startup. Request paths are normalized to "/a/b" form, which is what
+ * the caches key on and what the client sees in listings and redirects;
+ * docroot_rel() gives the name to pass to openat()/fstatat().
+ */
+extern int docroot;
+
+/*
+ * Large files are streamed with sendfile() and an explicit offset, which
+ * leaves the file position alone, so any number of connections can share
+ * one open descriptor. An entry is closed once it has left the cache and
+ * the last transfer using it is done.
+ */
+struct fd_entry {
+	char *key;
+	unsigned int hash;
+	int fd;
+	ino_t ino;
+	time_t mtime;
+	long mtime_nsec;
+	off_t size;
+	int refs;
+	struct fd_entry *hnext;
+	struct fd_entry *prev, *next; // LRU list, most recent first
+};
+
+int docroot_init(const char *dir);
+int path_normalize(const char *url, char *out, int size);
+struct fd_entry *fd_get(const char *path, struct stat *st);
+void fd_release(struct fd_entry *f);
+
+static inline const char *docroot_rel(const char *path)
+{
+	return path[1] ? path + 1 : ".";
+}
+
+// FNV-1a over a normalized path, what the file and fd caches hash on.
+static inline unsigned int path_hash(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+#endif
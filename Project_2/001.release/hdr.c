@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "hdr.h"
+
+#define HDR_HALF (1 << (HDR_SUB_BITS - 1))
+
+/*
+ * Values below 2^HDR_SUB_BITS get a bucket each. Above that, the top
+ * HDR_SUB_BITS bits select the bucket within the value's power of two.
+ */
+static int hdr_index(unsigned long v)
+{
+	int shift;
+
+	if (v >> HDR_MAX_BITS) v = (1UL << HDR_MAX_BITS) - 1;
+	if (v < 2 * HDR_HALF) return v;
+	shift = 63 - __builtin_clzl(v) - (HDR_SUB_BITS - 1);
+	return shift * HDR_HALF + (v >> shift);
+}
+
+// Largest value that falls into bucket i.
+static unsigned long hdr_value(int i)
+{
+	int shift;
+
+	if (i < 2 * HDR_HALF) return i;
+	shift = i / HDR_HALF - 1;
+	return ((unsigned long) (i - shift * HDR_HALF + 1) << shift) - 1;
+}
+
+struct hdr *hdr_new()
+{
+	struct hdr *h = calloc(1, sizeof(*h));
+
+	h->min = ~0UL;
+	return h;
+}
+
+void hdr_record(struct hdr *h, unsigned long v)
+{
+	h->counts[hdr_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v < h->min) h->min = v;
+	if (v > h->max) h->max = v;
+}
+
+void hdr_merge(struct hdr *to, struct hdr *from)
+{
+	int i;
+
+	for (i = 0; i < HDR_COUNTS; i++) to->counts[i] += from->counts[i];
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->min < to->min) to->min = from->min;
+	if (from->max > to->max) to->max = from->max;
+}
+
+unsigned long hdr_percentile(struct hdr *h, double p)
+{
+	unsigned long want = h->count * p / 100.0, seen = 0;
+	int i;
+
+	if (h->count == 0) return 0;
+	for (i = 0; i < HDR_COUNTS; i++) {
+		seen += h->counts[i];
+		if (seen > want) break;
+	}
+	return hdr_value(i) < h->max ? hdr_value(i) : h->max;
+}
+
+void hdr_format(char *buf, size_t size, unsigned long us)
+{
+	if (us < 10000) snprintf(buf, size, "%lu us", us);
+	else if (us < 10000000) snprintf(buf, size, "%.2f ms", us / 1000.0);
+	else snprintf(buf, size, "%.2f s", us / 1000000.0);
+}
+
+void hdr_print(FILE *f, char *name, struct hdr *h)
+{
+	static const double p[] = { 50, 90, 99, 99.9, 99.99 };
+	char buf[32];
+	int i;
+
+	fprintf(f, "%-13s", name);
+	if (h->count == 0) {
+		fprintf(f, "no samples\n");
+		return;
+	}
+	hdr_format(buf, sizeof(buf), h->sum / h->count);
+	fprintf(f, "mean %s", buf);
+	for (i = 0; i < sizeof(p) / sizeof(p[0]); i++) {
+		hdr_format(buf, sizeof(buf), hdr_percentile(h, p[i]));
+		fprintf(f, ", p%g %s", p[i], buf);
+	}
+	hdr_format(buf, sizeof(buf), h->max);
+	fprintf(f, ", max %s\n", buf);
+}
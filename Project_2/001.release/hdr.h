@@ -0,0 +1,31 @@
+#ifndef __HDR
+#define __HDR
+
+#include <stdio.h>
+
+#define HDR_SUB_BITS 11 // 1024 buckets per power of two: values kept to 3 significant digits
+#define HDR_MAX_BITS 40 // values up to 2^40 us, about 12 days
+#define HDR_COUNTS ((HDR_MAX_BITS - HDR_SUB_BITS + 2) << (HDR_SUB_BITS - 1))
+
+/*
+ * High dynamic range histogram of microsecond latencies for the load
+ * generator. Unlike the server's 8-per-octave struct histogram it keeps
+ * enough resolution to tell a p99.9 of 10.1 ms from one of 10.9 ms.
+ * One thread records into each; merge them to report.
+ */
+struct hdr {
+	unsigned long count;
+	unsigned long min;
+	unsigned long max;
+	double sum;
+	unsigned long counts[HDR_COUNTS];
+};
+
+struct hdr *hdr_new();
+void hdr_record(struct hdr *h, unsigned long v);
+void hdr_merge(struct hdr *to, struct hdr *from);
+unsigned long hdr_percentile(struct hdr *h, double p);
+void hdr_format(char *buf, size_t size, unsigned long us);
+void hdr_print(FILE *f, char *name, struct hdr *h);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "webserver.h"
+#include "header.h"
+#include "metrics.h"
+
+/*
+ * Content-Type lines are string literals built at compile time, so picking
+ * the header for a file is a table walk and a memcpy.
+ */
+#define MIME(ext, type, text) { ext, type, "Content-Type: " type "\r\n", sizeof("Content-Type: " type "\r\n") - 1, text }
+
+struct mime_type {
+	char *ext;
+	char *type;
+	char *header;
+	int header_len;
+	int text; // worth compressing
+};
+
+static struct mime_type mime_types[] = {
+	MIME(".html", "text/html", 1),
+	MIME(".htm", "text/html", 1),
+	MIME(".jpg", "image/jpeg", 0),
+	MIME(".jpeg", "image/jpeg", 0),
+	MIME(".gif", "image/gif", 0),
+	MIME(".png", "image/png", 0),
+	MIME(".css", "text/css", 1),
+	MIME(".js", "application/javascript", 1),
+	MIME(".txt", "text/plain", 1),
+	MIME(".svg", "image/svg+xml", 1),
+	MIME(".au", "audio/basic", 0),
+	MIME(".wav", "audio/wav", 0),
+	MIME(".avi", "video/x-msvideo", 0),
+	MIME(".mpeg", "video/mpeg", 0),
+	MIME(".mpg", "video/mpeg", 0),
+	MIME(".mp3", "audio/mpeg", 0),
+	{ NULL, NULL, NULL, 0, 0 }
+};
+
+static const char CONN_KEEP[] = "Connection: keep-alive\r\nKeep-Alive: timeout="
+	STR(KEEPALIVE_TIMEOUT) ", max=" STR(KEEPALIVE_MAX) "\r\n\r\n";
+static const char CONN_CLOSE[] = "Connection: close\r\n\r\n";
+_Static_assert(sizeof(CONN_KEEP) <= HEADER_RESERVE && sizeof(CONN_CLOSE) <= HEADER_RESERVE, "HEADER_RESERVE");
+
+// Two Date strings: the timer thread rewrites the one readers are not using and then flips.
+static char dates[2][64];
+static volatile int cur_date;
+
+static struct mime_type *find_mime(char *name)
+{
+	char *ext = strrchr(name, '.');
+	struct mime_type *m;
+
+	if (!ext) return NULL;
+	for (m = mime_types; m->ext; m++)
+		if (strcmp(ext, m->ext) == 0) return m;
+	return NULL;
+}
+
+char *get_mime_type(char *name) {
+	struct mime_type *m = find_mime(name);
+	return m ? m->type : NULL;
+}
+
+char *mime_header(char *name, int *len)
+{
+	struct mime_type *m = find_mime(name);
+
+	if (!m) return NULL;
+	*len = m->header_len;
+	return m->header;
+}
+
+int mime_compressible(char *name)
+{
+	struct mime_type *m = find_mime(name);
+
+	return m && m->text;
+}
+
+static void update_date()
+{
+	time_t now = time(NULL);
+	struct tm tm;
+	int next = !cur_date;
+
+	strftime(dates[next], sizeof(dates[next]), RFC1123FMT, gmtime_r(&now, &tm));
+	__sync_synchronize();
+	cur_date = next;
+}
+
+static void *date_timer(void *arg)
+{
+	struct timeval tv;
+
+	while (1) {
+		// wake just after the next second boundary
+		gettimeofday(&tv, NULL);
+		usleep(1000000 - tv.tv_usec);
+		update_date();
+	}
+	return NULL;
+}
+
+char *http_date()
+{
+	return dates[cur_date];
+}
+
+void header_init()
+{
+	pthread_t tid;
+	sigset_t all, old;
+
+	update_date();
+	// the timer thread must not take the signals meant for the accept loop
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_create(&tid, NULL, date_timer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(tid);
+}
+
+void header_clear(struct header *h)
+{
+	h->len = 0;
+	h->overflow = 0;
+}
+
+// Returns -1, and adds nothing, if s would not leave room for header_end().
+int header_add(struct header *h, const char *s, int len)
+{
+	if (h->overflow || h->len + len > sizeof(h->buf) - HEADER_RESERVE) {
+		h->overflow = 1;
+		return -1;
+	}
+	memcpy(h->buf + h->len, s, len);
+	h->len += len;
+	return 0;
+}
+
+// Append s followed by CRLF.
+void header_line(struct header *h, const char *s)
+{
+	header_add(h, s, strlen(s));
+	header_add(h, "\r\n", 2);
+}
+
+void header_start(struct header *h, int status, char *title)
+{
+	static const char server[] = "Server: " SERVER "\r\nDate: ";
+	char code[4];
+
+	stats_status(status);
+	header_clear(h);
+	code[0] = '0' + status / 100 % 10;
+	code[1] = '0' + status / 10 % 10;
+	code[2] = '0' + status % 10;
+	code[3] = ' ';
+	header_add(h, PROTOCOL " ", sizeof(PROTOCOL));
+	header_add(h, code, 4);
+	header_line(h, title);
+	header_add(h, server, sizeof(server) - 1);
+	header_add(h, http_date(), 29); // RFC 1123 dates are fixed width
+	header_add(h, "\r\n", 2);
+}
+
+void header_length(struct header *h, long length)
+{
+	char num[24];
+	int i = sizeof(num);
+
+	do {
+		num[--i] = '0' + length % 10;
+		length /= 10;
+	} while (length > 0);
+	header_add(h, "Content-Length: ", 16);
+	header_add(h, num + i, sizeof(num) - i);
+	header_add(h, "\r\n", 2);
+}
+
+void header_date(struct header *h, const char *name, time_t t)
+{
+	char line[128];
+	struct tm tm;
+	int n;
+
+	n = snprintf(line, sizeof(line), "%s: ", name);
+	n += strftime(line + n, sizeof(line) - n, RFC1123FMT "\r\n", gmtime_r(&t, &tm));
+	header_add(h, line, n);
+}
+
+/*
+ * A strong validator that changes whenever the file is replaced (inode),
+ * rewritten (mtime) or grows or shrinks (size), without reading it.
+ */
+void etag_format(char *etag, struct stat *st)
+{
+	snprintf(etag, ETAG_LEN, "\"%lx-%lx-%lx\"", (unsigned long) st->st_ino,
+		(unsigned long) st->st_size, (unsigned long) st->st_mtime);
+}
+
+void header_etag(struct header *h, const char *etag)
+{
+	header_add(h, "ETag: ", 6);
+	header_line(h, etag);
+}
+
+/*
+ * A compressible type may be sent coded or not depending on the request
+ * and on whether the file is cached at the time, so every response for
+ * one says so.
+ */
+void header_vary(struct header *h, char *path)
+{
+	if (mime_compressible(path)) header_add(h, VARY_ENCODING, sizeof(VARY_ENCODING) - 1);
+}
+
+// Uses the room header_add() keeps back, so the block is terminated whatever happened before.
+void header_end(struct header *h, int keep)
+{
+	const char *s = keep ? CONN_KEEP : CONN_CLOSE;
+	int len = keep ? sizeof(CONN_KEEP) - 1 : sizeof(CONN_CLOSE) - 1;
+
+	memcpy(h->buf + h->len, s, len);
+	h->len += len;
+}
@@ -0,0 +1,52 @@
+#ifndef __HEADER
+#define __HEADER
+
+#include <time.h>
+#include <sys/stat.h>
+
+#define SERVER "webserver/1.0"
+#define PROTOCOL "HTTP/1.1"
+#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define KEEPALIVE_TIMEOUT 5 // seconds an idle persistent connection is kept
+#define KEEPALIVE_MAX 100 // requests served on one connection before closing it
+#define REQUEST_TIMEOUT 10 // seconds to receive a whole request head, however it trickles in
+#define WRITE_TIMEOUT 10 // seconds any response may take, on top of what MIN_SEND_RATE allows
+#define MIN_SEND_RATE (64 * 1024) // bytes/s a client must at least take a body at
+
+#define ACCEPT_RANGES "Accept-Ranges: bytes\r\n"
+#define VARY_ENCODING "Vary: Accept-Encoding\r\n"
+#define ETAG_LEN 64 // room for "ino-size-mtime-encoding" in hex, quotes included
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+#define HEADER_RESERVE 64 // room kept for the lines header_end() adds
+
+/*
+ * A response header is assembled into one buffer and written together
+ * with (the start of) the body, so a response costs one writev(). A line
+ * that does not fit is dropped whole and overflow set, but the block is
+ * always terminated; a sender must not use a header that overflowed.
+ */
+struct header {
+	char buf[2048];
+	int len;
+	int overflow;
+};
+
+void header_init();
+void header_clear(struct header *h);
+void header_start(struct header *h, int status, char *title);
+int header_add(struct header *h, const char *s, int len);
+void header_line(struct header *h, const char *s);
+void header_length(struct header *h, long length);
+void header_date(struct header *h, const char *name, time_t t);
+void header_etag(struct header *h, const char *etag);
+void header_vary(struct header *h, char *path);
+void header_end(struct header *h, int keep);
+void etag_format(char *etag, struct stat *st);
+char *mime_header(char *name, int *len);
+int mime_compressible(char *name);
+char *http_date();
+
+#endif
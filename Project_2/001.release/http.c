@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "http.h"
+#include "metrics.h"
+#include "compress.h"
+
+static struct conn pool[CONN_POOL];
+static struct conn *free_conns;
+static int pool_ready;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Runs on the timer thread when a worker has waited too long on the
+ * client. Shutting the socket down makes the blocked read() return 0 or
+ * the blocked write fail, so the worker notices and closes it.
+ */
+static void conn_expire(struct timer *t)
+{
+	struct conn *c = (struct conn *) ((char *) t - offsetof(struct conn, deadline));
+
+	c->expired = 1;
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+struct conn *conn_get(int fd)
+{
+	struct conn *c;
+	socklen_t len = sizeof(c->peer);
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!pool_ready) {
+		for (i = 0; i < CONN_POOL; i++) {
+			pool[i].next = free_conns;
+			free_conns = &pool[i];
+		}
+		pool_ready = 1;
+	}
+	if ((c = free_conns) != NULL) free_conns = c->next;
+	pthread_mutex_unlock(&pool_lock);
+	if (c == NULL) c = malloc(sizeof(*c));
+
+	metrics_inc(active);
+	c->fd = fd;
+	c->len = 0;
+	c->pos = 0;
+	c->served = 0;
+	c->keep = 1;
+	c->body_fd = -1;
+	c->body_ref = NULL;
+	c->paid = 0;
+	c->pace.last = 0;
+	c->client = NULL;
+	c->deadline.fn = conn_expire;
+	c->deadline.pprev = NULL;
+	c->expired = 0;
+	c->waiting = 0;
+	c->idle = 0;
+	c->fresh = 0;
+	request_start(c);
+
+	// the address is only formatted if and when the log drainer prints it
+	if (getpeername(fd, (struct sockaddr *) &c->peer, &len) != 0)
+		memset(&c->peer, 0, sizeof(c->peer));
+	return c;
+}
+
+// Structs go back on the free list, including ones that had to be malloc()ed.
+void conn_put(struct conn *c)
+{
+	metrics_dec(active);
+	pthread_mutex_lock(&pool_lock);
+	c->next = free_conns;
+	free_conns = c;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Read more of the request. Returns the number of bytes read, 0 on EOF
+ * or once the deadline has shut the socket down, and -1 on error or when
+ * the buffer is full. flags go to recv(): with MSG_DONTWAIT it fails with
+ * EAGAIN instead of waiting for the client.
+ */
+int conn_fill(struct conn *c, int flags)
+{
+	int n;
+
+	if (c->len == sizeof(c->buf)) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	do {
+		n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, flags);
+	} while (n < 0 && errno == EINTR);
+	if (n > 0) c->len += n;
+	return n;
+}
+
+// Drop the request just served and move whatever was pipelined behind it to the front.
+void request_start(struct conn *c)
+{
+	if (c->pos > 0) {
+		memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+	}
+	c->scan = 0;
+	c->state = PARSE_REQUEST_LINE;
+	c->method = c->path = c->protocol = NULL;
+	c->if_modified_since = c->if_none_match = NULL;
+	c->range = c->if_range = NULL;
+	c->accept = 0;
+	c->content_length = -1;
+	c->transfer_encoding = 0;
+	c->http11 = 0;
+	c->large = 0;
+}
+
+// Split "METHOD SP PATH SP PROTOCOL" in place.
+static int parse_request_line(struct conn *c, char *line)
+{
+	char *sp;
+
+	c->method = line;
+	if ((sp = strchr(line, ' ')) == NULL) return -1;
+	*sp = '\0';
+	c->path = sp + 1;
+	if ((sp = strchr(c->path, ' ')) == NULL) return -1;
+	*sp = '\0';
+	c->protocol = sp + 1;
+	if (*c->method == '\0' || *c->path == '\0' || *c->protocol == '\0') return -1;
+	if (strlen(c->path) > MAX_TARGET) return -2;
+
+	c->http11 = strcmp(c->protocol, "HTTP/1.1") == 0;
+	c->keep = c->http11;
+	return 0;
+}
+
+// The value of line if it is header name (given with its colon), else NULL.
+static char *header_value(char *line, const char *name, int len)
+{
+	char *v;
+
+	if (strncasecmp(line, name, len) != 0) return NULL;
+	for (v = line + len; *v == ' ' || *v == '\t'; v++);
+	return v;
+}
+
+/*
+ * Turn an Accept-Encoding list into a bit per coding we have. Codings
+ * given q=0 are refused; "*" stands for any coding.
+ */
+static int parse_accept(char *v)
+{
+	int accept = 0, bits, len;
+	char *q, *end;
+
+	while (*v) {
+		while (*v == ' ' || *v == '\t' || *v == ',') v++;
+		for (end = v; *end && *end != ',' && *end != ';' && *end != ' '; end++);
+		len = end - v;
+		if (len == 2 && strncasecmp(v, "br", 2) == 0) bits = 1 << ENC_BR;
+		else if (len == 4 && strncasecmp(v, "gzip", 4) == 0) bits = 1 << ENC_GZIP;
+		else if (len == 1 && *v == '*') bits = (1 << ENC_COUNT) - 1;
+		else bits = 0;
+		for (v = end; *v && *v != ','; v++);
+		q = strstr(end, "q=");
+		if (q && q < v && strtod(q + 2, NULL) == 0) bits = 0;
+		accept |= bits;
+	}
+	return accept;
+}
+
+/*
+ * Take a Content-Length value. Returns -1 if it is not a plain decimal
+ * number or contradicts one given before, since the request's length is
+ * then ambiguous.
+ */
+static int parse_length(struct conn *c, char *v)
+{
+	char *end;
+	long n;
+
+	if (*v < '0' || *v > '9') return -1;
+	errno = 0;
+	n = strtol(v, &end, 10);
+	while (*end == ' ' || *end == '\t') end++;
+	if (*end || errno) return -1;
+	if (c->content_length >= 0 && c->content_length != n) return -1;
+	c->content_length = n;
+	return 0;
+}
+
+static int parse_header(struct conn *c, char *line)
+{
+	char *v;
+
+	if ((v = header_value(line, "Connection:", 11)) != NULL) {
+		if (strncasecmp(v, "close", 5) == 0) c->keep = 0;
+		else if (strncasecmp(v, "keep-alive", 10) == 0) c->keep = 1;
+	} else if ((v = header_value(line, "If-Modified-Since:", 18)) != NULL) {
+		c->if_modified_since = v;
+	} else if ((v = header_value(line, "If-None-Match:", 14)) != NULL) {
+		c->if_none_match = v;
+	} else if ((v = header_value(line, "Range:", 6)) != NULL) {
+		c->range = v;
+	} else if ((v = header_value(line, "If-Range:", 9)) != NULL) {
+		c->if_range = v;
+	} else if ((v = header_value(line, "Accept-Encoding:", 16)) != NULL) {
+		c->accept = parse_accept(v);
+	} else if ((v = header_value(line, "Content-Length:", 15)) != NULL) {
+		return parse_length(c, v);
+	} else if (header_value(line, "Transfer-Encoding:", 18) != NULL) {
+		c->transfer_encoding = 1;
+	}
+	return 0;
+}
+
+/*
+ * Parse as much of the buffered request as has arrived. Lines are cut in
+ * place, so nothing is copied or allocated. Returns 1 once the header
+ * block is complete (c->pos then points past it), 0 if more input is
+ * needed, -1 for a malformed request line or Content-Length and -2 for
+ * a path longer than MAX_TARGET.
+ *
+ * No request we serve has a body, so one that comes with a body is
+ * answered and the connection closed after it: the buffered part of the
+ * body is skipped and keep-alive is off, so none of it can be taken for
+ * a pipelined request. A Transfer-Encoding body has no length we know.
+ */
+int request_parse(struct conn *c)
+{
+	char *line, *nl;
+	int start = c->pos + c->scan;
+	int r;
+
+	while (c->state != PARSE_DONE) {
+		nl = memchr(c->buf + start, '\n', c->len - start);
+		if (nl == NULL) {
+			c->scan = start - c->pos;
+			return 0;
+		}
+		line = c->buf + start;
+		*nl = '\0';
+		if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+		start = nl - c->buf + 1;
+
+		if (c->state == PARSE_REQUEST_LINE) {
+			if (*line == '\0') continue; // stray CRLF between requests
+			if ((r = parse_request_line(c, line)) < 0) return r;
+			c->state = PARSE_HEADERS;
+		} else if (*line == '\0') {
+			c->state = PARSE_DONE;
+		} else if (parse_header(c, line) < 0) {
+			return -1;
+		}
+	}
+	if (c->transfer_encoding || c->content_length > 0) {
+		c->keep = 0;
+		if (!c->transfer_encoding)
+			start += c->len - start < c->content_length ? c->len - start : c->content_length;
+	}
+	c->pos = start;
+	return 1;
+}
@@ -0,0 +1,73 @@
+#ifndef __HTTP
+#define __HTTP
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "timer.h"
+#include "pace.h"
+
+#define CONN_BUF 8192 // request line plus headers must fit, pipelined requests queue up behind
+#define MAX_TARGET 1024 // longest request path taken, so one echoed in a Location header fits
+#define CONN_POOL 64 // connection structs preallocated, the pool grows past this on demand
+
+enum { PARSE_REQUEST_LINE, PARSE_HEADERS, PARSE_DONE };
+
+/*
+ * Everything a connection needs between accept and close. The request
+ * fields point into buf and stay valid until the next request is started.
+ */
+struct fd_entry;
+
+struct conn {
+	int fd;
+	struct sockaddr_in peer;
+	char buf[CONN_BUF];
+	int len; // bytes in buf
+	int pos; // start of the current request
+	int scan; // start of the first line not parsed yet, relative to pos
+	int state;
+	int served;
+
+	char *method;
+	char *path;
+	char *protocol;
+	int http11;
+	int keep;
+	char *if_modified_since; // validators sent by the client, NULL if absent
+	char *if_none_match;
+	char *range;
+	char *if_range;
+	int accept; // content codings the client takes, a bit per ENC_*
+	long content_length; // -1 if not given
+	int transfer_encoding; // the request has a Transfer-Encoding header, which we do not decode
+	unsigned long long started; // now_usec() when the request was parsed
+
+	int body_fd; // file still being streamed to the client, -1 if none
+	struct fd_entry *body_ref; // ... and the fd cache entry that keeps it open
+	off_t body_off;
+	off_t body_left;
+	int large; // the response is streamed from disk rather than sent from memory
+	off_t paid; // body bytes already paid for in the pacing buckets but not yet sent
+	unsigned long pace_wait; // usec the next chunk has to wait when conn_serve() returns 2
+	struct bucket pace; // this connection's share of -s
+	struct pace_client *client; // ... and its client's of -i, held while a body is in flight
+
+	struct timer deadline; // armed while a worker reads from or writes to the client
+	int expired; // the deadline fired and the socket was shut down
+	int waiting; // the next request head is awaited and the deadline for it already armed
+	int idle; // ... and nothing of it has arrived since the last request
+	int left; // ... and the ms the deadline had left when the client sent more
+	int fresh; // webserver_multi: accepted and waiting for its client, conn_start() not run yet
+	struct timer wake; // webserver_multi: brings a parked paced connection back
+	void *owner; // ... to this pool
+
+	struct conn *next; // free list
+};
+
+struct conn *conn_get(int fd);
+void conn_put(struct conn *c);
+int conn_fill(struct conn *c, int flags);
+void request_start(struct conn *c);
+int request_parse(struct conn *c);
+
+#endif
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Each thread logs into its own single-producer single-consumer ring, so
+ * logging from a worker is a few memcpy()s and one release store: no
+ * lock, no stdio and nothing shared with other workers. A drainer thread
+ * formats the records and writes them to stdout in LOG_BATCH sized
+ * chunks. When a ring is full the record is dropped and counted, the
+ * worker never waits for the drainer.
+ */
+struct log_ring {
+	struct log_record slots[LOG_RING];
+	unsigned long head __attribute__((aligned(64))); // next slot to fill, written by the owner
+	unsigned long tail __attribute__((aligned(64))); // next slot to drain, written by the drainer
+	int tid;
+	int orphan; // owner thread has exited, the ring can be handed to a new thread
+	struct log_ring *next;
+};
+
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring;
+
+static void ring_orphan(void *arg)
+{
+	struct log_ring *r = arg;
+
+	__atomic_store_n(&r->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *ring_attach()
+{
+	struct log_ring *r;
+
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r; r = r->next)
+		if (__atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE)) break;
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		r->next = rings;
+		rings = r;
+	}
+	r->orphan = 0;
+	r->tid = gettid();
+	pthread_mutex_unlock(&rings_lock);
+
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+/*
+ * Log an event. The remaining arguments are strings, ended by NULL, that
+ * are concatenated into the record's text (truncated to LOG_TEXT).
+ */
+void log_event(int event, struct sockaddr_in *peer, ...)
+{
+	struct log_ring *r = my_ring ? my_ring : ring_attach();
+	unsigned long head = r->head;
+	struct log_record *rec;
+	va_list ap;
+	char *s;
+	int len = 0, n;
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING) {
+		metrics_inc(log_dropped);
+		return;
+	}
+
+	rec = &r->slots[head & (LOG_RING - 1)];
+	rec->tid = r->tid;
+	rec->event = event;
+	rec->port = peer ? peer->sin_port : 0;
+	rec->addr = peer ? peer->sin_addr.s_addr : 0;
+	va_start(ap, peer);
+	while ((s = va_arg(ap, char *)) != NULL) {
+		n = strlen(s);
+		if (n > LOG_TEXT - 1 - len) n = LOG_TEXT - 1 - len;
+		memcpy(rec->text + len, s, n);
+		len += n;
+	}
+	va_end(ap);
+	rec->text[len] = '\0';
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int format_record(char *out, int size, struct log_record *rec, int pid)
+{
+	char ip[INET_ADDRSTRLEN];
+	struct in_addr addr;
+
+	addr.s_addr = rec->addr;
+	inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+	switch (rec->event) {
+	case LOG_CONNECT:
+		return snprintf(out, size, "[pid %d, tid %d] Received a request from %s:%d\n",
+			pid, rec->tid, ip, ntohs(rec->port));
+	case LOG_URL:
+		if (rec->port)
+			return snprintf(out, size, "[pid %d, tid %d] (from %s:%d) URL: %s\n",
+				pid, rec->tid, ip, ntohs(rec->port), rec->text);
+		return snprintf(out, size, "[pid %d, tid %d] URL: %s\n", pid, rec->tid, rec->text);
+	case LOG_REPLY:
+		return snprintf(out, size, "[pid %d, tid %d] Reply: %s\n", pid, rec->tid, rec->text);
+	case LOG_CRASH:
+		return snprintf(out, size, "Thread [pid %d, tid %d] terminated!\n", pid, rec->tid);
+	}
+	return 0;
+}
+
+// Status lines still go through stdio, flush them first to keep the order.
+static void write_all(char *buf, int len)
+{
+	int n;
+
+	fflush(stdout);
+	while (len > 0 && (n = write(STDOUT_FILENO, buf, len)) > 0) {
+		buf += n;
+		len -= n;
+	}
+}
+
+// Drain every ring once. Returns the number of records written.
+static int drain()
+{
+	static char batch[LOG_BATCH];
+	struct log_ring *r;
+	unsigned long head;
+	int pid = getpid();
+	int len = 0, count = 0, n;
+
+	pthread_mutex_lock(&drain_lock);
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		while (r->tail != head) {
+			if (len > LOG_BATCH - 512) {
+				write_all(batch, len);
+				len = 0;
+			}
+			n = format_record(batch + len, LOG_BATCH - len, &r->slots[r->tail & (LOG_RING - 1)], pid);
+			if (n > LOG_BATCH - len) n = LOG_BATCH - len;
+			len += n;
+			count++;
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (len > 0) write_all(batch, len);
+	pthread_mutex_unlock(&drain_lock);
+	return count;
+}
+
+static void *drainer(void *arg)
+{
+	while (1) {
+		if (drain() == 0) usleep(LOG_IDLE * 1000);
+	}
+	return NULL;
+}
+
+void log_init()
+{
+	pthread_t tid;
+	sigset_t all, old;
+
+	pthread_key_create(&ring_key, ring_orphan);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_create(&tid, NULL, drainer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(tid);
+}
+
+// Write out everything logged so far, e.g. before the shutdown report.
+void log_flush()
+{
+	drain();
+}
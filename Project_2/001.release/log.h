@@ -0,0 +1,31 @@
+#ifndef __LOG
+#define __LOG
+
+#include <netinet/in.h>
+
+#define LOG_RING 1024 // records per thread, a power of two
+#define LOG_TEXT 116
+#define LOG_BATCH (64 << 10) // bytes formatted before each write()
+#define LOG_IDLE 10 // ms the drainer sleeps when every ring is empty
+
+enum {
+	LOG_CONNECT,
+	LOG_URL,
+	LOG_REPLY,
+	LOG_CRASH,
+};
+
+// One fixed-size record; formatting into text happens on the drainer thread.
+struct log_record {
+	int tid;
+	unsigned short event;
+	unsigned short port; // network order, 0 if the peer is unknown
+	unsigned int addr;
+	char text[LOG_TEXT];
+};
+
+void log_init();
+void log_event(int event, struct sockaddr_in *peer, ...);
+void log_flush();
+
+#endif
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "pace.h"
+
+struct metrics metrics;
+
+__thread struct thread_stats *my_stats;
+static struct thread_stats *all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+unsigned long long now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int hist_index(unsigned long v)
+{
+	int shift;
+
+	if (v < 16) return v;
+	shift = 63 - __builtin_clzl(v) - 3;
+	return shift * 8 + (v >> shift);
+}
+
+// Largest value that falls into bucket i.
+static unsigned long hist_value(int i)
+{
+	int shift;
+
+	if (i < 16) return i;
+	shift = i / 8 - 1;
+	return ((unsigned long) (i - shift * 8 + 1) << shift) - 1;
+}
+
+void hist_record(struct histogram *h, unsigned long v)
+{
+	unsigned long max;
+
+	__sync_fetch_and_add(&h->buckets[hist_index(v)], 1);
+	__sync_fetch_and_add(&h->count, 1);
+	while ((max = h->max) < v && !__sync_bool_compare_and_swap(&h->max, max, v));
+}
+
+// For histograms only one thread writes to.
+void hist_add(struct histogram *h, unsigned long v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	if (v > h->max) h->max = v;
+}
+
+static void hist_merge(struct histogram *to, struct histogram *from)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) to->buckets[i] += from->buckets[i];
+	to->count += from->count;
+	if (from->max > to->max) to->max = from->max;
+}
+
+unsigned long hist_percentile(struct histogram *h, double p)
+{
+	unsigned long want = h->count * p / 100.0, seen = 0;
+	int i;
+
+	if (h->count == 0) return 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want) break;
+	}
+	return hist_value(i) < h->max ? hist_value(i) : h->max;
+}
+
+static void hist_print(FILE *f, char *name, struct histogram *h)
+{
+	fprintf(f, "%-19s%lu samples, p50 %lu us, p90 %lu us, p99 %lu us, p99.9 %lu us, max %lu us\n",
+		name, h->count, hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99),
+		hist_percentile(h, 99.9), h->max);
+}
+
+static void stats_orphan(void *arg)
+{
+	struct thread_stats *s = arg;
+
+	__atomic_store_n(&s->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static void stats_key_init()
+{
+	pthread_key_create(&stats_key, stats_orphan);
+}
+
+/*
+ * Give the calling thread its counter block. Blocks are never freed: one
+ * left by an exited thread is handed on with its counts, so the totals
+ * stay right when the pool shrinks and grows again.
+ */
+struct thread_stats *stats_attach()
+{
+	struct thread_stats *s;
+
+	pthread_once(&stats_once, stats_key_init);
+	pthread_mutex_lock(&stats_lock);
+	for (s = all_stats; s; s = s->next)
+		if (__atomic_load_n(&s->orphan, __ATOMIC_ACQUIRE)) break;
+	if (s == NULL) {
+		s = calloc(1, sizeof(*s));
+		s->next = all_stats;
+		__atomic_store_n(&all_stats, s, __ATOMIC_RELEASE);
+	}
+	s->orphan = 0;
+	s->tid = gettid();
+	pthread_mutex_unlock(&stats_lock);
+
+	pthread_setspecific(stats_key, s);
+	my_stats = s;
+	return s;
+}
+
+void stats_status(int status)
+{
+	if (status >= STATUS_MIN && status <= STATUS_MAX) stats()->status[status - STATUS_MIN]++;
+}
+
+// Add up every thread's block into sum.
+static void stats_sum(struct thread_stats *sum)
+{
+	struct thread_stats *s;
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (s = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); s; s = s->next) {
+		sum->requests += s->requests;
+		sum->bytes += s->bytes;
+		sum->busy_usec += s->busy_usec;
+		for (i = 0; i <= STATUS_MAX - STATUS_MIN; i++) sum->status[i] += s->status[i];
+		hist_merge(&sum->service_small, &s->service_small);
+		hist_merge(&sum->service_large, &s->service_large);
+	}
+}
+
+void metrics_print(FILE *f)
+{
+	long elapsed = time(NULL) - metrics.started;
+	struct thread_stats *sum = malloc(sizeof(*sum));
+	int i;
+
+	if (elapsed < 1) elapsed = 1;
+	stats_sum(sum);
+	for (i = 0; i < MAX_LISTENER; i++) {
+		if (metrics.accepts[i] == 0) continue;
+		fprintf(f, "listener %2d:       %lu accepts, %.1f/s\n", i, metrics.accepts[i],
+			(double) metrics.accepts[i] / elapsed);
+	}
+	fprintf(f, "connections:       %lu\n", metrics.connections);
+	fprintf(f, "requests:          %lu\n", sum->requests);
+	fprintf(f, "bytes sent:        %lu\n", sum->bytes);
+	fprintf(f, "keepalive reuse:   %lu\n", metrics.keepalive_reuse);
+	fprintf(f, "keepalive timeout: %lu\n", metrics.keepalive_timeout);
+	fprintf(f, "slow clients:      %lu reading, %lu writing\n", metrics.slow_read, metrics.slow_write);
+	fprintf(f, "pipelined:         %lu\n", metrics.pipelined);
+	fprintf(f, "cache hits:        %lu\n", metrics.cache_hits);
+	fprintf(f, "cache misses:      %lu, %lu more coalesced\n", metrics.cache_misses, metrics.cache_coalesced);
+	fprintf(f, "cache evictions:   %lu\n", metrics.cache_evictions);
+	fprintf(f, "fd cache:          %lu hits, %lu misses\n", metrics.fd_hits, metrics.fd_misses);
+	fprintf(f, "conditional:       %lu, %lu not modified\n", metrics.conditional, metrics.not_modified);
+	fprintf(f, "compressed:        %lu, %lu bytes saved\n", metrics.encoded, metrics.encoded_saved);
+	fprintf(f, "shed (depth):      %lu\n", metrics.shed_depth);
+	fprintf(f, "shed (wait):       %lu\n", metrics.shed_wait);
+	fprintf(f, "large body slices: %lu\n", metrics.slices);
+	if (pacing())
+		fprintf(f, "throttled:         %lu chunks, %lu bytes, %.1fs waiting\n", metrics.throttled,
+			metrics.throttled_bytes, metrics.throttled_usec / 1e6);
+	if (conf.affinity) fprintf(f, "steered to CPU:    %lu\n", metrics.steered);
+	fprintf(f, "log dropped:       %lu\n", metrics.log_dropped);
+	if (metrics.queue_wait.count) hist_print(f, "queue wait:", &metrics.queue_wait);
+	if (sum->service_small.count) hist_print(f, "service (small):", &sum->service_small);
+	if (sum->service_large.count) hist_print(f, "service (large):", &sum->service_large);
+	free(sum);
+}
+
+static void hist_json(FILE *f, char *name, struct histogram *h, int last)
+{
+	int i, first = 1;
+
+	fprintf(f, "\t\t\"%s\": {\"count\": %lu, \"max\": %lu, \"p50\": %lu, \"p90\": %lu, "
+		"\"p99\": %lu, \"p999\": %lu, \"buckets\": [", name, h->count, h->max,
+		hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99), hist_percentile(h, 99.9));
+	// only the buckets in use, as [largest value in bucket, count]
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (h->buckets[i] == 0) continue;
+		fprintf(f, "%s[%lu, %lu]", first ? "" : ", ", hist_value(i), h->buckets[i]);
+		first = 0;
+	}
+	fprintf(f, "]}%s\n", last ? "" : ",");
+}
+
+/*
+ * The /__stats document. Times are in microseconds. Worker utilization
+ * is given both as the share of workers busy right now and as the share
+ * of worker time spent serving requests since startup.
+ */
+void metrics_json(FILE *f)
+{
+	long elapsed = time(NULL) - metrics.started;
+	struct thread_stats *sum = malloc(sizeof(*sum));
+	struct thread_stats *s;
+	int i, first = 1;
+
+	if (elapsed < 1) elapsed = 1;
+	stats_sum(sum);
+	fprintf(f, "{\n\t\"pid\": %d,\n\t\"uptime\": %ld,\n", getpid(), elapsed);
+	fprintf(f, "\t\"requests\": %lu,\n\t\"bytes_sent\": %lu,\n", sum->requests, sum->bytes);
+	fprintf(f, "\t\"status\": {");
+	for (i = 0; i <= STATUS_MAX - STATUS_MIN; i++) {
+		if (sum->status[i] == 0) continue;
+		fprintf(f, "%s\"%d\": %lu", first ? "" : ", ", i + STATUS_MIN, sum->status[i]);
+		first = 0;
+	}
+	fprintf(f, "},\n");
+	fprintf(f, "\t\"connections\": {\"accepted\": %lu, \"active\": %d, \"waiting\": %d, \"keepalive_reuse\": %lu, "
+		"\"keepalive_timeout\": %lu, \"pipelined\": %lu, \"slow_read\": %lu, \"slow_write\": %lu},\n",
+		metrics.connections, metrics.active, metrics.waiting, metrics.keepalive_reuse, metrics.keepalive_timeout,
+		metrics.pipelined, metrics.slow_read, metrics.slow_write);
+	fprintf(f, "\t\"queue\": {\"depth\": %d, \"shed_depth\": %lu, \"shed_wait\": %lu, \"slices\": %lu, "
+		"\"steered\": %lu},\n", metrics.queued, metrics.shed_depth, metrics.shed_wait, metrics.slices, metrics.steered);
+	fprintf(f, "\t\"workers\": {\"live\": %d, \"busy\": %d, \"utilization\": %.3f, \"busy_ratio\": %.3f},\n",
+		metrics.workers, metrics.workers - metrics.idle,
+		metrics.workers > 0 ? (double) (metrics.workers - metrics.idle) / metrics.workers : 0.0,
+		metrics.workers > 0 ? sum->busy_usec / (elapsed * 1e6 * metrics.workers) : 0.0);
+	fprintf(f, "\t\"cache\": {\"hits\": %lu, \"misses\": %lu, \"coalesced\": %lu, \"evictions\": %lu, "
+		"\"fd_hits\": %lu, \"fd_misses\": %lu},\n", metrics.cache_hits, metrics.cache_misses,
+		metrics.cache_coalesced, metrics.cache_evictions, metrics.fd_hits, metrics.fd_misses);
+	fprintf(f, "\t\"conditional\": {\"requests\": %lu, \"not_modified\": %lu, \"hit_rate\": %.3f},\n",
+		metrics.conditional, metrics.not_modified,
+		metrics.conditional > 0 ? (double) metrics.not_modified / metrics.conditional : 0.0);
+	fprintf(f, "\t\"compression\": {\"responses\": %lu, \"bytes_saved\": %lu},\n",
+		metrics.encoded, metrics.encoded_saved);
+	fprintf(f, "\t\"pacing\": {\"rate\": %ld, \"client_rate\": %ld, \"conn_rate\": %ld, \"throttled\": %lu, "
+		"\"throttled_bytes\": %lu, \"throttled_usec\": %lu},\n", conf.rate, conf.client_rate, conf.conn_rate,
+		metrics.throttled, metrics.throttled_bytes, metrics.throttled_usec);
+	fprintf(f, "\t\"log_dropped\": %lu,\n", metrics.log_dropped);
+	fprintf(f, "\t\"threads\": [");
+	first = 1;
+	for (s = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); s; s = s->next) {
+		if (s->requests == 0 && s->bytes == 0) continue;
+		fprintf(f, "%s\n\t\t{\"tid\": %d, \"requests\": %lu, \"bytes\": %lu, \"busy_usec\": %lu}",
+			first ? "" : ",", s->tid, s->requests, s->bytes, s->busy_usec);
+		first = 0;
+	}
+	fprintf(f, "\n\t],\n\t\"histograms\": {\n");
+	hist_json(f, "queue_wait", &metrics.queue_wait, 0);
+	hist_json(f, "service_small", &sum->service_small, 0);
+	hist_json(f, "service_large", &sum->service_large, 1);
+	fprintf(f, "\t}\n}\n");
+	free(sum);
+}
@@ -0,0 +1,95 @@
+#ifndef __METRICS
+#define __METRICS
+
+#include <stdio.h>
+#include <time.h>
+#include "config.h"
+
+#define HIST_BUCKETS 512
+
+/*
+ * Log-linear histogram of microsecond values: 8 buckets per power of two,
+ * so any value is recorded within 12.5%.
+ */
+struct histogram {
+	unsigned long count;
+	unsigned long max;
+	unsigned long buckets[HIST_BUCKETS];
+};
+
+/*
+ * Counters that every request touches live in a block per thread, so
+ * recording is a plain increment on a line no other thread writes.
+ * Readers add the blocks up; they may see a count a moment stale.
+ */
+#define STATUS_MIN 100
+#define STATUS_MAX 599
+
+struct thread_stats {
+	int tid;
+	int orphan; // owner has exited, the block goes to the next new thread
+	unsigned long requests;
+	unsigned long bytes; // response bytes written to sockets
+	unsigned long busy_usec; // time spent serving requests
+	unsigned long status[STATUS_MAX - STATUS_MIN + 1];
+	struct histogram service_small; // request parsed to response sent, bodies sent from memory
+	struct histogram service_large; // ... bodies streamed from disk
+	struct thread_stats *next;
+};
+
+struct metrics {
+	time_t started;
+	int active; // connections open right now
+	int queued; // connections waiting for a worker
+	int waiting; // ... for their client to send, which they do without one
+	int workers; // live worker threads
+	int idle; // ... of which waiting for work
+	unsigned long accepts[MAX_LISTENER]; // per listening socket
+	unsigned long connections;
+	unsigned long keepalive_reuse;	// requests served on an already used connection
+	unsigned long keepalive_timeout;
+	unsigned long slow_read; // connections dropped for not sending a request head within REQUEST_TIMEOUT
+	unsigned long slow_write; // ... for not taking a response fast enough
+	unsigned long pipelined; // requests already buffered when the previous one finished
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long cache_coalesced; // misses that waited for another thread's load of the same file
+	unsigned long cache_evictions;
+	unsigned long fd_hits; // streamed files sent from an already open descriptor
+	unsigned long fd_misses;
+	unsigned long conditional; // GETs that carried If-None-Match or If-Modified-Since
+	unsigned long not_modified; // ... answered 304 because the client's copy was current
+	unsigned long encoded; // responses sent gzip or br coded
+	unsigned long encoded_saved; // ... and the body bytes that saved
+	unsigned long shed_depth; // connections turned away with 503 because the queue was too long
+	unsigned long shed_wait; // ... because the oldest queued connection had waited too long
+	unsigned long slices; // times a large body was put back in the queue half sent
+	unsigned long throttled; // body chunks held back by -g, -i or -s
+	unsigned long throttled_bytes; // ... the bytes in them
+	unsigned long throttled_usec; // ... and the time senders slept for them
+	unsigned long steered; // connections accepted on one CPU's listener and queued for another's
+	unsigned long log_dropped; // log records lost because a thread's log ring was full
+	struct histogram queue_wait;
+};
+
+extern struct metrics metrics;
+
+#define metrics_inc(field) __sync_fetch_and_add(&metrics.field, 1)
+#define metrics_add(field, n) __sync_fetch_and_add(&metrics.field, (n))
+#define metrics_dec(field) __sync_fetch_and_sub(&metrics.field, 1)
+
+extern __thread struct thread_stats *my_stats;
+struct thread_stats *stats_attach();
+
+#define stats() (my_stats ? my_stats : stats_attach())
+#define stats_add(field, n) (stats()->field += (n))
+
+unsigned long long now_usec();
+void hist_record(struct histogram *h, unsigned long v);
+void hist_add(struct histogram *h, unsigned long v);
+unsigned long hist_percentile(struct histogram *h, double p);
+void stats_status(int status);
+void metrics_print(FILE *f);
+void metrics_json(FILE *f);
+
+#endif
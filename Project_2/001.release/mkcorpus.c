@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+
+/*
+ * mkcorpus DIR SCENARIO [SEED]: fill DIR with a document root for the
+ * benchmark and write the URL mix of a client scenario that requests it;
+ * the phases are up to whoever runs it. The same seed always gives the
+ * same files, byte for byte, so runs on different trees compare like
+ * for like.
+ */
+struct size_class {
+	char *name;
+	char *pattern; // under DIR, %d numbers the files
+	int count;
+	long min, max; // bytes, picked log-uniformly between them
+	int text;
+	int weight; // share of requests in the scenario
+};
+
+static struct size_class classes[] = {
+	{ "small", "small/%d.html", 2000, 512, 16384, 1, 85 },
+	{ "medium", "medium/%d.js", 200, 32768, 524288, 1, 13 },
+	{ "large", "large/%d.mp3", 10, 2097152, 16777216, 0, 2 },
+};
+
+#define NCLASS (sizeof(classes) / sizeof(classes[0]))
+
+static unsigned long long rng;
+
+static unsigned long long next()
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+static double uniform()
+{
+	return (next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int write_file(char *path, long size, int text)
+{
+	static const char *words[] = { "the", "server", "request", "thread", "cache", "file",
+		"socket", "queue", "latency", "worker", "header", "body", "page", "index" };
+	char buf[65536];
+	unsigned long long r;
+	long left = size;
+	int n, i, w;
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (left > 0) {
+		n = left < sizeof(buf) ? left : sizeof(buf);
+		if (text) {
+			// words and line breaks, so compressors see something like real markup
+			for (i = 0; i < n; ) {
+				w = next() % (sizeof(words) / sizeof(words[0]));
+				i += snprintf(buf + i, sizeof(buf) - i, "%s%c", words[w], next() % 12 ? ' ' : '\n');
+				if (i >= n) break;
+			}
+		} else {
+			for (i = 0; i < n; i += 8) {
+				r = next();
+				memcpy(buf + i, &r, n - i < 8 ? n - i : 8);
+			}
+		}
+		fwrite(buf, 1, n, f);
+		left -= n;
+	}
+	return fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	char path[4096], dir[4096];
+	long size;
+	FILE *scen;
+	int c, i;
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: %s DIR SCENARIO [SEED]\n", argv[0]);
+		return 2;
+	}
+	rng = argc == 4 ? strtoull(argv[3], NULL, 0) : 4370;
+	if (rng == 0) rng = 1;
+	if (mkdir(argv[1], 0755) < 0 && errno != EEXIST) {
+		perror(argv[1]);
+		return 1;
+	}
+	if ((scen = fopen(argv[2], "w")) == NULL) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	fprintf(scen, "# written by mkcorpus for %s, seed %s\n", argv[1], argc == 4 ? argv[3] : "4370");
+	for (c = 0; c < NCLASS; c++) {
+		snprintf(dir, sizeof(dir), "%s/%s", argv[1], classes[c].name);
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+			perror(dir);
+			return 1;
+		}
+		for (i = 0; i < classes[c].count; i++) {
+			size = classes[c].min * exp2(uniform() * log2((double) classes[c].max / classes[c].min));
+			snprintf(dir, sizeof(dir), "%s/%s", argv[1], classes[c].pattern);
+			snprintf(path, sizeof(path), dir, i);
+			if (write_file(path, size, classes[c].text) < 0) return 1;
+		}
+		fprintf(scen, "range /%s 0 %d %s\n", classes[c].pattern, classes[c].count - 1, classes[c].name);
+		fprintf(scen, "weight %s %d\n", classes[c].name, classes[c].weight);
+	}
+	fprintf(scen, "zipf 1.0\n");
+	fclose(scen);
+	return 0;
+}
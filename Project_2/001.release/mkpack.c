@@ -0,0 +1,289 @@
+#define _GNU_SOURCE // qsort_r()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "header.h"
+#include "pack.h"
+
+#define MAX_TRIES (1 << 20) // displacements tried for one bucket before the table is made larger
+
+/*
+ * mkpack DIR FILE: freeze the tree under DIR into a pack that
+ * webserver -P FILE serves without touching the file system.
+ */
+struct item {
+	char *key;
+	char *file; // source of the body, NULL for a redirect
+	struct stat st;
+	int status;
+	int same_as; // item whose body this one shares, or -1
+	char *header;
+	struct pack_entry e;
+};
+
+static struct item *items;
+static int count, room;
+
+// header.c counts response statuses; mkpack links without metrics.c and sends none.
+void stats_status(int status)
+{
+}
+
+static struct item *add_item(char *key, char *file, struct stat *st, int status)
+{
+	struct item *it;
+
+	if (count == room) {
+		room = room ? room * 2 : 256;
+		items = realloc(items, room * sizeof(*items));
+	}
+	it = &items[count++];
+	memset(it, 0, sizeof(*it));
+	it->key = strdup(key);
+	it->file = file ? strdup(file) : NULL;
+	it->st = *st;
+	it->status = status;
+	it->same_as = -1;
+	return it;
+}
+
+/*
+ * Add every file under dir, reached in URLs as prefix (which ends in
+ * '/'). Returns 1 if dir has an index.html to serve it by. As in the live
+ * server a directory without one would be a listing, which a pack cannot
+ * hold, so only a directory with one is redirected to from its bare name.
+ */
+static int walk(char *dir, char *prefix)
+{
+	char file[4096], key[4096];
+	struct dirent *de;
+	struct stat st;
+	int index = -1;
+	DIR *d;
+
+	if ((d = opendir(dir)) == NULL) {
+		perror(dir);
+		return 0;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+		snprintf(file, sizeof(file), "%s/%s", dir, de->d_name);
+		snprintf(key, sizeof(key), "%s%s", prefix, de->d_name);
+		if (stat(file, &st) < 0) continue;
+		if (S_ISDIR(st.st_mode)) {
+			strcat(key, "/");
+			if (walk(file, key)) {
+				key[strlen(key) - 1] = '\0';
+				add_item(key, NULL, &st, 302);
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			if (strcmp(de->d_name, "index.html") == 0) index = count;
+			add_item(key, file, &st, 200);
+		}
+	}
+	closedir(d);
+
+	// the directory itself is served by its index.html, as in the live server
+	if (index >= 0) {
+		struct item *it = add_item(prefix, items[index].file, &items[index].st, 200);
+		it->same_as = index;
+	}
+	return index >= 0;
+}
+
+static int bucket_order(const void *a, const void *b, void *sizes)
+{
+	return ((int *) sizes)[*(int *) b] - ((int *) sizes)[*(int *) a];
+}
+
+/*
+ * Hash and displace: place the buckets largest first, each with the
+ * first displacement that sends all of its keys to free slots. Fills in
+ * the slot of every item, or returns -1 if some bucket found no room.
+ */
+static int place(uint32_t buckets, uint32_t slots, uint32_t *disp, int *slot_of)
+{
+	int *sizes = calloc(buckets + 1, sizeof(int));
+	int *start = calloc(buckets + 1, sizeof(int));
+	int *members = malloc((count + 1) * sizeof(int));
+	int *order = malloc(buckets * sizeof(int));
+	char *taken = calloc(slots, 1);
+	int i, j, n, b, ok = 0;
+	uint32_t d, s;
+
+	// group the items by bucket
+	for (i = 0; i < count; i++) sizes[pack_hash(items[i].key, strlen(items[i].key), 0) % buckets]++;
+	for (b = 0; b < buckets; b++) start[b + 1] = start[b] + sizes[b];
+	for (b = 0; b < buckets; b++) sizes[b] = 0;
+	for (i = 0; i < count; i++) {
+		b = pack_hash(items[i].key, strlen(items[i].key), 0) % buckets;
+		members[start[b] + sizes[b]++] = i;
+	}
+	for (b = 0; b < buckets; b++) order[b] = b;
+	qsort_r(order, buckets, sizeof(int), bucket_order, sizes);
+
+	for (j = 0; j < buckets && sizes[order[j]] > 0; j++) {
+		b = order[j];
+		for (d = 1; d < MAX_TRIES; d++) {
+			for (n = 0; n < sizes[b]; n++) {
+				i = members[start[b] + n];
+				s = pack_hash(items[i].key, strlen(items[i].key), d) % slots;
+				if (taken[s]) break;
+				taken[s] = 1;
+				slot_of[i] = s;
+			}
+			if (n == sizes[b]) break;
+			// undo the keys of this bucket placed so far and try the next displacement
+			while (n-- > 0) taken[slot_of[members[start[b] + n]]] = 0;
+		}
+		if (d == MAX_TRIES) goto out;
+		disp[b] = d;
+	}
+	ok = 1;
+out:
+	free(sizes);
+	free(start);
+	free(members);
+	free(order);
+	free(taken);
+	return ok ? 0 : -1;
+}
+
+static int copy_body(int out, struct item *it)
+{
+	char buf[65536];
+	uint64_t off = it->e.body_off;
+	ssize_t n;
+	int in;
+
+	if ((in = open(it->file, O_RDONLY)) < 0) {
+		perror(it->file);
+		return -1;
+	}
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (pwrite(out, buf, n, off) != n) {
+			close(in);
+			return -1;
+		}
+		off += n;
+	}
+	close(in);
+	return n < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pack_header *head;
+	struct pack_entry *slots_at;
+	struct header h;
+	struct stat st;
+	uint32_t buckets, slots, *disp;
+	uint64_t off, body_end;
+	int *slot_of;
+	char *meta, *mime, *name;
+	int i, out, len;
+
+	if (argc != 3) {
+		fprintf(stderr, "./mkpack DIR FILE\n");
+		return 1;
+	}
+	if (stat(argv[1], &st) < 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", argv[1]);
+		return 1;
+	}
+	walk(argv[1], "/");
+
+	// buckets kept even so that the slot table after disp[] stays 8 byte aligned
+	buckets = (count / PACK_BUCKET + 2) & ~1u;
+	slots = count > 0 ? count : 1;
+	disp = calloc(buckets, sizeof(uint32_t));
+	slot_of = malloc((count + 1) * sizeof(int));
+	while (place(buckets, slots, disp, slot_of) < 0) {
+		slots += slots / 10 + 1;
+		memset(disp, 0, buckets * sizeof(uint32_t));
+	}
+
+	// lay out keys and precomputed headers, then page aligned bodies
+	off = sizeof(*head) + buckets * sizeof(uint32_t) + slots * (uint64_t) sizeof(struct pack_entry);
+	for (i = 0; i < count; i++) {
+		struct item *it = &items[i];
+
+		header_clear(&h);
+		if (it->status == 302) {
+			header_add(&h, "Location: ", 10);
+			header_add(&h, it->key, strlen(it->key));
+			header_add(&h, "/\r\n", 3);
+			header_length(&h, 0);
+		} else {
+			name = it->key[strlen(it->key) - 1] == '/' ? "index.html" : it->key;
+			if ((mime = mime_header(name, &len)) != NULL) header_add(&h, mime, len);
+			header_length(&h, it->st.st_size);
+			header_add(&h, ACCEPT_RANGES, sizeof(ACCEPT_RANGES) - 1);
+			header_vary(&h, name);
+			header_date(&h, "Last-Modified", it->st.st_mtime);
+			etag_format(it->e.etag, &it->st);
+			header_etag(&h, it->e.etag);
+			it->e.body_len = it->st.st_size;
+			it->e.mtime = it->st.st_mtime;
+		}
+		it->e.status = it->status;
+		it->e.key_off = off;
+		it->e.key_len = strlen(it->key);
+		off += it->e.key_len;
+		it->header = malloc(h.len);
+		memcpy(it->header, h.buf, h.len);
+		it->e.header_off = off;
+		it->e.header_len = h.len;
+		off += h.len;
+	}
+	meta = calloc(1, off);
+	for (i = 0; i < count; i++) {
+		struct item *it = &items[i];
+
+		memcpy(meta + it->e.key_off, it->key, it->e.key_len);
+		memcpy(meta + it->e.header_off, it->header, it->e.header_len);
+	}
+	body_end = (off + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+	for (i = 0; i < count; i++) {
+		struct item *it = &items[i];
+
+		if (it->status != 200) continue;
+		if (it->same_as >= 0) {
+			it->e.body_off = items[it->same_as].e.body_off;
+			continue;
+		}
+		it->e.body_off = body_end;
+		body_end = (body_end + it->st.st_size + PACK_ALIGN - 1) & ~(uint64_t) (PACK_ALIGN - 1);
+	}
+
+	head = (struct pack_header *) meta;
+	memcpy(head->magic, PACK_MAGIC, 8);
+	head->buckets = buckets;
+	head->slots = slots;
+	head->size = body_end;
+	memcpy(meta + sizeof(*head), disp, buckets * sizeof(uint32_t));
+	slots_at = (struct pack_entry *) (meta + sizeof(*head) + buckets * sizeof(uint32_t));
+	for (i = 0; i < count; i++) slots_at[slot_of[i]] = items[i].e;
+
+	if ((out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	if (pwrite(out, meta, off, 0) != off) {
+		perror(argv[2]);
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		if (items[i].status == 200 && items[i].same_as < 0 && copy_body(out, &items[i]) < 0) return 1;
+	}
+	if (ftruncate(out, body_end) < 0 || close(out) < 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	printf("%d paths, %u slots, %llu bytes in %s\n", count, slots, (unsigned long long) body_end, argv[2]);
+	return 0;
+}
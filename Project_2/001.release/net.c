@@ -1,17 +1,37 @@
+#define _GNU_SOURCE // strptime(), timegm()
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <linux/unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/time.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "cache.h"
+#include "header.h"
+#include "http.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+#include "docroot.h"
+#include "pack.h"
+#include "pace.h"
 
-
-#define SERVER "webserver/1.0"
-#define PROTOCOL "HTTP/1.0"
-#define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
+#define SLICE_BYTES (256 << 10) // body bytes sent before a sliced connection goes back to the queue
+#define STATS_PATH "/__stats"
 
 int CRASH = 0;
 
@@ -19,185 +39,951 @@ int gettid() {
 	return syscall(__NR_gettid) - getpid();
 }
 
-char *get_mime_type(char *name) {
-	char *ext = strrchr(name, '.');
-	if (!ext) return NULL;
-	if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0) return "text/html";
-	if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-	if (strcmp(ext, ".gif") == 0) return "image/gif";
-	if (strcmp(ext, ".png") == 0) return "image/png";
-	if (strcmp(ext, ".css") == 0) return "text/css";
-	if (strcmp(ext, ".au") == 0) return "audio/basic";
-	if (strcmp(ext, ".wav") == 0) return "audio/wav";
-	if (strcmp(ext, ".avi") == 0) return "video/x-msvideo";
-	if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0) return "video/mpeg";
-	if (strcmp(ext, ".mp3") == 0) return "audio/mpeg";
-	return NULL;
-}
-
-void send_headers(FILE *f, int status, char *title, char *extra, char *mime, 
-	int length, time_t date) {
-	time_t now;
-	char timebuf[128];
-
-	fprintf(f, "%s %d %s\r\n", PROTOCOL, status, title);
-	fprintf(f, "Server: %s\r\n", SERVER);
-	now = time(NULL);
-	strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-	fprintf(f, "Date: %s\r\n", timebuf);
-	if (extra) fprintf(f, "%s\r\n", extra);
-	if (mime) fprintf(f, "Content-Type: %s\r\n", mime);
-	if (length >= 0) fprintf(f, "Content-Length: %d\r\n", length);
-	if (date != -1) {
-		strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&date));
-		fprintf(f, "Last-Modified: %s\r\n", timebuf);
-	}
-	fprintf(f, "Connection: close\r\n");
-	fprintf(f, "\r\n");
-}
-
-void send_error(FILE *f, int status, char *title, char *extra, char *text) {
-	send_headers(f, status, title, extra, "text/html", -1, -1);
-	fprintf(f, "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\r\n", status, title);
-	fprintf(f, "<BODY><H4>%d %s</H4>\r\n", status, title);
-	fprintf(f, "%s\r\n", text);
-	fprintf(f, "</BODY></HTML>\r\n");
-}
-
-void send_file(FILE *f, char *path, struct stat *statbuf) {
-	char data[4096];
+/*
+ * Open a socket listening on port. With reuseport set, several sockets
+ * (in one process or many) can be bound to the same port and the kernel
+ * spreads incoming connections across them.
+ */
+int open_listener(int port, int reuseport)
+{
+	struct sockaddr_in sin;
+	int sock, on = 1;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Error creating socket:");
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		perror("Error setting SO_REUSEPORT:");
+	if (conf.defer_accept > 0)
+		setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &conf.defer_accept, sizeof(conf.defer_accept));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		perror("Error binding socket:");
+		close(sock);
+		return -1;
+	}
+	if (listen(sock, conf.backlog) < 0) {
+		perror("Error listening socket:");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+#define RETRY_AFTER 1 // seconds a shed client is asked to back off
+#define BUSY_BODY "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\r\n" \
+	"<BODY><H4>503 Service Unavailable</H4>\r\nServer is busy.\r\n</BODY></HTML>\r\n"
+#define BUSY_LEN 132
+_Static_assert(sizeof(BUSY_BODY) - 1 == BUSY_LEN, "BUSY_LEN must match BUSY_BODY");
+
+static const char busy_response[] = PROTOCOL " 503 Service Unavailable\r\n"
+	"Server: " SERVER "\r\n"
+	"Retry-After: " STR(RETRY_AFTER) "\r\n"
+	"Content-Type: text/html\r\n"
+	"Content-Length: " STR(BUSY_LEN) "\r\n"
+	"Connection: close\r\n\r\n"
+	BUSY_BODY;
+
+/*
+ * Turn a connection away without reading its request. This runs on the
+ * accept thread, so it must never block: the canned response goes out
+ * with one non-blocking send, and whatever the client already sent is
+ * drained so that close() does not answer with a reset.
+ */
+void send_unavailable(int fd)
+{
+	char junk[1024];
+
+	if (send(fd, busy_response, sizeof(busy_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) > 0) {
+		stats_status(503);
+		stats_add(bytes, sizeof(busy_response) - 1);
+	}
+	shutdown(fd, SHUT_WR);
+	while (recv(fd, junk, sizeof(junk), MSG_DONTWAIT) > 0);
+	close(fd);
+}
+
+// Write out all of iov, resuming after short writes.
+int write_iov(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		stats_add(bytes, n);
+		while (cnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+void send_error(int fd, int status, char *title, char *extra, char *text, int keep);
+
+/*
+ * A header that overflowed is missing lines, perhaps its Content-Length,
+ * so it is replaced by a 500 and the socket shut down: the connection
+ * ends once the worker next reads from it.
+ */
+static int header_failed(int fd, struct header *h)
+{
+	if (!h->overflow) return 0;
+	send_error(fd, 500, "Internal Server Error", NULL, "Response header too large.", 0);
+	shutdown(fd, SHUT_RDWR);
+	return 1;
+}
+
+// A body from memory rides along with the header, so it is traced as part of it.
+static int send_response(int fd, struct header *h, char *body, size_t len)
+{
+	unsigned long long t = trace_now();
+	struct iovec iov[2];
+	int r;
+
+	if (header_failed(fd, h)) return -1;
+	iov[0].iov_base = h->buf;
+	iov[0].iov_len = h->len;
+	iov[1].iov_base = body;
+	iov[1].iov_len = len;
+	r = write_iov(fd, iov, len > 0 ? 2 : 1);
+	trace_span(TRACE_HEADER, fd, t);
+	return r;
+}
+
+// Error pages are formatted up front so they carry a Content-Length and
+// do not force the connection closed.
+void send_error(int fd, int status, char *title, char *extra, char *text, int keep) {
+	struct header h;
+	char body[4096];
+	int n;
+
+	n = snprintf(body, sizeof(body), "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\r\n"
+		"<BODY><H4>%d %s</H4>\r\n%s\r\n</BODY></HTML>\r\n", status, title, status, title, text);
+	if (n >= sizeof(body)) n = sizeof(body) - 1;
+	header_start(&h, status, title);
+	if (extra) header_line(&h, extra);
+	header_add(&h, "Content-Type: text/html\r\n", 25);
+	header_length(&h, n);
+	header_end(&h, keep);
+	send_response(fd, &h, body, n);
+}
+
+// Whether an entity tag in list, an If-None-Match value, matches etag.
+static int etag_match(char *list, const char *etag)
+{
+	int len = strlen(etag);
+	char *p = list;
+
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		if (*p == '*') return 1;
+		if (p[0] == 'W' && p[1] == '/') p += 2; // weak comparison, as for GET
+		if (strncmp(p, etag, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\t'))
+			return 1;
+		while (*p && *p != ',') p++;
+	}
+	return 0;
+}
+
+/*
+ * If the client's validators show its copy is current, answer 304 and
+ * return 1; else return 0 and the full response goes out. If-None-Match
+ * takes precedence over If-Modified-Since.
+ */
+static int not_modified(struct conn *c, char *path, const char *etag, time_t mtime)
+{
+	struct header h;
+	struct tm tm;
+	int match;
+
+	if (c->if_none_match) {
+		match = etag_match(c->if_none_match, etag);
+	} else if (c->if_modified_since) {
+		memset(&tm, 0, sizeof(tm));
+		match = strptime(c->if_modified_since, RFC1123FMT, &tm) != NULL && mtime <= timegm(&tm);
+	} else {
+		return 0;
+	}
+	metrics_inc(conditional);
+	if (!match) return 0;
+	metrics_inc(not_modified);
+
+	header_start(&h, 304, "Not Modified");
+	header_etag(&h, etag);
+	header_date(&h, "Last-Modified", mtime);
+	header_vary(&h, path);
+	header_end(&h, c->keep);
+	send_response(c->fd, &h, NULL, 0);
+	return 1;
+}
+
+/*
+ * Find the byte range the client asked for in a body of size bytes.
+ * Returns 1 with [*start, *start + *len) for one satisfiable range, -1
+ * if the range cannot be satisfied, and 0 to send the whole body: no or
+ * a malformed Range, an If-Range that no longer matches, or several
+ * ranges, which a server may always answer in full.
+ */
+static int parse_range(struct conn *c, const char *etag, time_t mtime, off_t size, off_t *start, off_t *len)
+{
+	long long first, last;
+	struct tm tm;
+	char *p;
+	int n;
+
+	if (c->range == NULL || strncmp(c->range, "bytes=", 6) != 0) return 0;
+	if (c->if_range) {
+		if (*c->if_range == '"') {
+			// the whole value must be our tag, not merely start with it
+			for (n = strlen(c->if_range); n > 0 && (c->if_range[n - 1] == ' ' || c->if_range[n - 1] == '\t'); n--);
+			if (n != strlen(etag) || strncmp(c->if_range, etag, n) != 0) return 0;
+		} else {
+			memset(&tm, 0, sizeof(tm));
+			if (strptime(c->if_range, RFC1123FMT, &tm) == NULL || timegm(&tm) != mtime) return 0;
+		}
+	}
+	if (strchr(c->range, ',')) return 0;
+
+	p = c->range + 6;
+	if (*p == '-') {
+		// the last n bytes
+		if (p[1] < '0' || p[1] > '9') return 0;
+		last = strtoll(p + 1, &p, 10);
+		if (*p != '\0') return 0;
+		if (last == 0 || size == 0) return -1;
+		*start = last < size ? size - last : 0;
+		*len = size - *start;
+		return 1;
+	}
+	if (*p < '0' || *p > '9') return 0;
+	first = strtoll(p, &p, 10);
+	if (*p++ != '-') return 0;
+	last = size - 1;
+	if (*p != '\0') {
+		last = strtoll(p, &p, 10);
+		if (*p != '\0' || last < first) return 0;
+		if (last >= size) last = size - 1;
+	}
+	if (first >= size) return -1;
+	*start = first;
+	*len = last - first + 1;
+	return 1;
+}
+
+// The 206 header for bytes [start, start + len) of a size byte file.
+static void range_header(struct header *h, char *path, const char *etag, time_t mtime,
+	off_t start, off_t len, off_t size, int keep)
+{
+	char line[128];
+	char *mime;
+	int n;
+
+	header_start(h, 206, "Partial Content");
+	if ((mime = mime_header(path, &n)) != NULL) header_add(h, mime, n);
+	header_length(h, len);
+	n = snprintf(line, sizeof(line), "Content-Range: bytes %lld-%lld/%lld\r\n",
+		(long long) start, (long long) (start + len - 1), (long long) size);
+	header_add(h, line, n);
+	header_vary(h, path);
+	header_date(h, "Last-Modified", mtime);
+	header_etag(h, etag);
+	header_end(h, keep);
+}
+
+static void send_unsatisfiable(struct conn *c, off_t size)
+{
+	char line[64];
+
+	snprintf(line, sizeof(line), "Content-Range: bytes */%lld", (long long) size);
+	send_error(c->fd, 416, "Range Not Satisfiable", line, "Requested range not satisfiable.", c->keep);
+}
+
+void send_cached(struct conn *c, struct cache_entry *e) {
+	struct cache_variant *v;
+	struct header h;
+	off_t start, len;
+	int r;
+
+	// ranges count in bytes of the file as is, so a Range request is never sent coded
+	if (c->accept && c->range == NULL && (v = cache_variant(e, c->accept)) != NULL) {
+		if (not_modified(c, e->key, v->etag, e->mtime)) return;
+		metrics_inc(encoded);
+		metrics_add(encoded_saved, e->len - v->len);
+		header_start(&h, 200, "OK");
+		header_add(&h, v->header, v->header_len);
+		header_end(&h, c->keep);
+		send_response(c->fd, &h, v->body, v->len);
+		return;
+	}
+	if (e->type == CACHE_FILE) {
+		if (not_modified(c, e->key, e->etag, e->mtime)) return;
+		if ((r = parse_range(c, e->etag, e->mtime, e->len, &start, &len)) < 0) {
+			send_unsatisfiable(c, e->len);
+			return;
+		}
+		if (r > 0) {
+			range_header(&h, e->key, e->etag, e->mtime, start, len, e->len, c->keep);
+			send_response(c->fd, &h, e->body + start, len);
+			return;
+		}
+	}
+	header_start(&h, 200, "OK");
+	header_add(&h, e->header, e->header_len);
+	header_end(&h, c->keep);
+	send_response(c->fd, &h, e->body, e->len);
+}
+
+// The live counters as JSON, never cached.
+static void send_stats(int fd, int keep)
+{
+	static const char type[] = "Content-Type: application/json\r\nCache-Control: no-store\r\n";
+	struct header h;
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&body, &len);
+
+	metrics_json(f);
+	fclose(f);
+	header_start(&h, 200, "OK");
+	header_add(&h, type, sizeof(type) - 1);
+	header_length(&h, len);
+	header_end(&h, keep);
+	send_response(fd, &h, body, len);
+	free(body);
+}
+
+/*
+ * Send the header h and leave bytes [off, off + len) of file for
+ * send_body(). f, if not NULL, is the fd cache entry that keeps file open.
+ */
+static void start_body(struct conn *c, struct header *h, int file, struct fd_entry *f, off_t off, off_t len)
+{
+	unsigned long long t = trace_now();
 	int n;
 
-	FILE *file = fopen(path, "r");
-	if (!file) {
-		send_error(f, 403, "Forbidden", NULL, "Access denied.");
+	if (header_failed(c->fd, h)) {
+		c->keep = 0;
+		if (f) fd_release(f);
+		return;
+	}
+	// MSG_MORE lets the header share a segment with the start of the body
+	n = send(c->fd, h->buf, h->len, MSG_MORE);
+	trace_span(TRACE_HEADER, c->fd, t);
+	if (n != h->len) {
+		c->keep = 0;
+		if (f) fd_release(f);
+		return;
+	}
+	stats_add(bytes, h->len);
+	// sendfile() starts at the given offset, the file is never read into user space
+	c->body_ref = f;
+	c->body_fd = file;
+	c->body_off = off;
+	c->body_left = len;
+	c->large = 1;
+}
+
+/*
+ * Start a response whose body is streamed from disk. Only the header is
+ * written here; conn_serve() pushes the body with send_body(), in slices
+ * if the connection is to share its worker.
+ */
+void send_file(struct conn *c, char *path, struct stat *statbuf) {
+	struct header h;
+	char etag[ETAG_LEN];
+	char data[4096];
+	char *mime;
+	off_t start = 0, size = statbuf->st_size;
+	struct fd_entry *f = NULL;
+	int n, len, range = 0, file;
+
+	if (S_ISREG(statbuf->st_mode)) {
+		f = fd_get(path, statbuf);
+		file = f ? f->fd : -1;
 	} else {
-		int length = S_ISREG(statbuf->st_mode) ? statbuf->st_size : -1;
-		send_headers(f, 200, "OK", NULL, get_mime_type(path), length, statbuf->st_mtime);
+		file = openat(docroot, docroot_rel(path), O_RDONLY | O_CLOEXEC);
+	}
+	if (file < 0) {
+		send_error(c->fd, 403, "Forbidden", NULL, "Access denied.", c->keep);
+		return;
+	}
 
-		while ((n = fread(data, 1, sizeof(data), file)) > 0) fwrite(data, 1, n, f);
-		fclose(file);
+	if (f) {
+		size = statbuf->st_size;
+		etag_format(etag, statbuf);
+		if (not_modified(c, path, etag, statbuf->st_mtime)) {
+			fd_release(f);
+			return;
+		}
+		if ((range = parse_range(c, etag, statbuf->st_mtime, statbuf->st_size, &start, &size)) < 0) {
+			send_unsatisfiable(c, statbuf->st_size);
+			fd_release(f);
+			return;
+		}
 	}
+
+	if (range) {
+		range_header(&h, path, etag, statbuf->st_mtime, start, size, statbuf->st_size, c->keep);
+	} else {
+		header_start(&h, 200, "OK");
+		if ((mime = mime_header(path, &len)) != NULL) header_add(&h, mime, len);
+		if (S_ISREG(statbuf->st_mode)) {
+			header_length(&h, statbuf->st_size);
+			header_add(&h, ACCEPT_RANGES, sizeof(ACCEPT_RANGES) - 1);
+		} else {
+			c->keep = 0;
+		}
+		header_vary(&h, path);
+		header_date(&h, "Last-Modified", statbuf->st_mtime);
+		if (S_ISREG(statbuf->st_mode)) header_etag(&h, etag);
+		header_end(&h, c->keep);
+	}
+
+	if (!S_ISREG(statbuf->st_mode)) {
+		// no length to slice by, copy until EOF
+		if (send_response(c->fd, &h, NULL, 0) == 0) {
+			while ((n = read(file, data, sizeof(data))) > 0) {
+				struct iovec iov = { data, n };
+				if (write_iov(c->fd, &iov, 1) < 0) break;
+			}
+		}
+		close(file);
+		return;
+	}
+
+	start_body(c, &h, file, f, start, size);
 }
 
-int process(int fd) {
-	char buf[4096];
-	char *method;
-	char *_path;
-	char path[4096];
-	char *protocol;
-	struct stat statbuf;
-	char pathbuf[4096];
-	char cwd[1024];
+/*
+ * Send the rest of a streamed body with sendfile(). With slice set, stop
+ * after SLICE_BYTES and return 1 so that the caller can put the
+ * connection back behind waiting small requests. Returns 0 once the body
+ * is done or the transfer failed. Under -g, -i or -s the body goes out
+ * in chunks of up to PACE_CHUNK, each paid for before it is sent. While
+ * the buckets are in debt a sliced connection returns 2 with the wait in
+ * c->pace_wait, so its worker can serve others; otherwise the thread
+ * sleeps.
+ */
+static int send_body(struct conn *c, int slice)
+{
+	off_t budget = slice ? SLICE_BYTES : c->body_left;
+	off_t want;
+	unsigned long long t = trace_now();
+	unsigned long wait;
+	ssize_t n;
+
+	if (budget > c->body_left) budget = c->body_left;
+	timer_arm(&c->deadline, WRITE_TIMEOUT * 1000 + budget * 1000 / MIN_SEND_RATE);
+	while (c->body_left > 0 && budget > 0) {
+		want = c->body_left < budget ? c->body_left : budget;
+		if (pacing()) {
+			if (c->paid == 0) {
+				c->paid = want < PACE_CHUNK ? want : PACE_CHUNK;
+				if ((wait = pace_take(c, c->paid)) > 0) {
+					// time spent waiting on the rate limits is not the client's to answer for
+					timer_cancel(&c->deadline);
+					if (slice) {
+						c->pace_wait = wait;
+						trace_span(TRACE_BODY, c->fd, t);
+						return 2;
+					}
+					pace_sleep(wait);
+					timer_arm(&c->deadline, WRITE_TIMEOUT * 1000 + budget * 1000 / MIN_SEND_RATE);
+				}
+			}
+			if (want > c->paid) want = c->paid;
+		}
+		n = sendfile(c->fd, c->body_fd, &c->body_off, want);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			// client gone or file truncated under us, the length we promised is wrong now
+			c->keep = 0;
+			c->body_left = 0;
+			break;
+		}
+		c->body_left -= n;
+		budget -= n;
+		c->paid = c->paid > n ? c->paid - n : 0;
+		stats_add(bytes, n);
+	}
+	timer_cancel(&c->deadline);
+	trace_span(TRACE_BODY, c->fd, t);
+	if (c->body_left > 0) return 1;
+	c->paid = 0;
+	pace_done(c);
+	if (c->body_ref) fd_release(c->body_ref);
+	c->body_ref = NULL;
+	c->body_fd = -1;
+	return 0;
+}
+
+/*
+ * Listings are rendered into memory (fd < 0) so they can be cached and
+ * sent with a Content-Length. One that outgrows CACHE_MAX_FILE is instead
+ * streamed: HTTP/1.1 clients get it in chunked encoding so the connection
+ * survives, everyone else gets a plain body terminated by closing the
+ * connection. The response header rides along with the first chunk.
+ */
+struct chunked {
+	int fd;
+	int chunked;
+	struct header *h;
+	char *mem;
+	size_t mem_len;
+	int overflow;
 	int len;
-	struct sockaddr_in peer;
-	int peer_len = sizeof(peer);
-	FILE *f;
-	
-	srand(syscall(__NR_gettid) + time(NULL));
-	if(CRASH > 0 && rand() % 100 < CRASH) {
-		printf("Thread [pid %d, tid %d] terminated!\n", getpid(), gettid());
-		close(fd);
-		pthread_exit(NULL);
+	char buf[4096];
+};
+
+static void chunk_flush(struct chunked *c, int last)
+{
+	struct iovec iov[5];
+	char size[16];
+	int cnt = 0;
+
+	if (c->fd < 0) {
+		if (c->mem_len + c->len > CACHE_MAX_FILE) {
+			c->overflow = 1;
+		} else if (c->len > 0) {
+			c->mem = realloc(c->mem, c->mem_len + c->len);
+			memcpy(c->mem + c->mem_len, c->buf, c->len);
+			c->mem_len += c->len;
+		}
+		c->len = 0;
+		return;
+	}
+	if (c->h) {
+		iov[cnt].iov_base = c->h->buf;
+		iov[cnt++].iov_len = c->h->len;
+		c->h = NULL;
+	}
+	if (c->len > 0) {
+		if (c->chunked) {
+			iov[cnt].iov_base = size;
+			iov[cnt++].iov_len = snprintf(size, sizeof(size), "%x\r\n", c->len);
+		}
+		iov[cnt].iov_base = c->buf;
+		iov[cnt++].iov_len = c->len;
+		if (c->chunked) {
+			iov[cnt].iov_base = "\r\n";
+			iov[cnt++].iov_len = 2;
+		}
+	}
+	if (last && c->chunked) {
+		iov[cnt].iov_base = "0\r\n\r\n";
+		iov[cnt++].iov_len = 5;
 	}
+	write_iov(c->fd, iov, cnt);
+	c->len = 0;
+}
 
-	f = fdopen(fd, "a+");
-	sleep(1); // do not change
+static void chunk_printf(struct chunked *c, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
 
-	if(getpeername(fd, (struct sockaddr*) &peer, &peer_len) != -1) {
-		printf("[pid %d, tid %d] Received a request from %s:%d\n", getpid(), gettid(), inet_ntoa(peer.sin_addr), (int)ntohs(peer.sin_port));
+	va_start(ap, fmt);
+	n = vsnprintf(c->buf + c->len, sizeof(c->buf) - c->len, fmt, ap);
+	va_end(ap);
+	if (n >= sizeof(c->buf) - c->len) {
+		chunk_flush(c, 0);
+		va_start(ap, fmt);
+		n = vsnprintf(c->buf, sizeof(c->buf), fmt, ap);
+		va_end(ap);
+		if (n >= sizeof(c->buf)) n = sizeof(c->buf) - 1;
 	}
+	c->len += n;
+}
 
-	if(f == NULL) {
-		printf("fileopen error: %s\n", fd);
-		return -1;
+static void list_dir(struct chunked *c, char *path)
+{
+	DIR *dir = NULL;
+	struct dirent *de;
+	struct stat statbuf;
+	int len = strlen(path);
+	int fd;
+
+	chunk_printf(c, "<HTML><HEAD><TITLE>Index of %s</TITLE></HEAD>\r\n<BODY>", path);
+	chunk_printf(c, "<H4>Index of %s</H4>\r\n<PRE>\n", path);
+	chunk_printf(c, "Name                             Last Modified              Size\r\n");
+	chunk_printf(c, "<HR>\r\n");
+	if (len > 1) chunk_printf(c, "<A HREF=\"..\">..</A>\r\n");
+
+	if ((fd = openat(docroot, docroot_rel(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0
+			&& (dir = fdopendir(fd)) == NULL)
+		close(fd);
+	while (dir && !c->overflow && (de = readdir(dir)) != NULL) {
+		char timebuf[32];
+		struct tm tm;
+
+		// resolve entries relative to the open directory rather than re-walking path
+		if (fstatat(dirfd(dir), de->d_name, &statbuf, 0) < 0) continue;
+		strftime(timebuf, sizeof(timebuf), "%d-%b-%Y %H:%M:%S", gmtime_r(&statbuf.st_mtime, &tm));
+
+		chunk_printf(c, "<A HREF=\"%s%s\">", de->d_name, S_ISDIR(statbuf.st_mode) ? "/" : "");
+		chunk_printf(c, "%s%s", de->d_name, S_ISDIR(statbuf.st_mode) ? "/</A>" : "</A> ");
+		if (strlen(de->d_name) < 32) chunk_printf(c, "%*s", 32 - strlen(de->d_name), "");
+		if (S_ISDIR(statbuf.st_mode)) {
+			chunk_printf(c, "%s\r\n", timebuf);
+		} else {
+			chunk_printf(c, "%s %10d\r\n", timebuf, statbuf.st_size);
+		}
 	}
+	if (dir) closedir(dir);
 
-	if (!fgets(buf, sizeof(buf), f)) {
-		fclose(f);
-		return -1;
+	chunk_printf(c, "</PRE>\r\n<HR>\r\n<ADDRESS>%s</ADDRESS>\r\n</BODY></HTML>\r\n", SERVER);
+	chunk_flush(c, 1);
+}
+
+// Render the listing of path and cache it. Returns NULL if it is too large to keep.
+static struct cache_entry *render_dir(char *path, struct stat *statbuf)
+{
+	struct chunked c;
+	struct header h;
+
+	c.fd = -1;
+	c.chunked = 0;
+	c.h = NULL;
+	c.mem = NULL;
+	c.mem_len = 0;
+	c.overflow = 0;
+	c.len = 0;
+	list_dir(&c, path);
+	if (c.overflow) {
+		free(c.mem);
+		return NULL;
 	}
 
-	if(getpeername(fileno(f), (struct sockaddr*) &peer, &peer_len) != -1) {
-		printf("[pid %d, tid %d] (from %s:%d) URL: %s", getpid(), gettid(),inet_ntoa(peer.sin_addr), (int)ntohs(peer.sin_port), buf);
+	header_clear(&h);
+	header_add(&h, "Content-Type: text/html\r\n", 25);
+	header_length(&h, c.mem_len);
+	header_date(&h, "Last-Modified", statbuf->st_mtime);
+	return cache_put(path, statbuf, CACHE_LISTING, h.buf, h.len, c.mem, c.mem_len);
+}
+
+int send_dir(int fd, char *path, struct stat *statbuf, int http11, int keep) {
+	struct chunked c;
+	struct header h;
+
+	if (!http11) keep = 0;
+	header_start(&h, 200, "OK");
+	if (http11) header_add(&h, "Transfer-Encoding: chunked\r\n", 28);
+	header_add(&h, "Content-Type: text/html\r\n", 25);
+	header_date(&h, "Last-Modified", statbuf->st_mtime);
+	header_end(&h, keep);
+
+	c.fd = fd;
+	c.chunked = http11;
+	c.h = &h;
+	c.overflow = 0;
+	c.len = 0;
+	list_dir(&c, path);
+	return keep;
+}
+
+// cache_get(), traced as the resolve phase.
+static int resolve(int fd, char *path, struct stat *st, struct cache_entry **ep)
+{
+	unsigned long long t = trace_now();
+	int r = cache_get(path, st, ep);
+
+	trace_span(TRACE_RESOLVE, fd, t);
+	return r;
+}
+
+// Send the file at path, from the cache when possible.
+static void serve_file(struct conn *c, char *path) {
+	struct stat statbuf;
+	struct cache_entry *e;
+
+	if (resolve(c->fd, path, &statbuf, &e) < 0) {
+		send_error(c->fd, 404, "Not Found", NULL, "File not found.", c->keep);
+	} else if (e) {
+		send_cached(c, e);
+		cache_release(e);
 	} else {
-		printf("[pid %d, tid %d] URL: %s", getpid(), gettid(), buf);
+		send_file(c, path, &statbuf);
 	}
+}
 
-	method = strtok(buf, " ");
-	_path = strtok(NULL, " ");
-	protocol = strtok(NULL, "\r");
-	if (!method || !_path || !protocol) {
-		fclose(f);
-		return -1;
+/*
+ * In pack mode (-P) every response comes from the mapped pack: the
+ * index, keys and header blocks are in memory and bodies are sent from
+ * the pack fd, so a request costs no file system call at all.
+ */
+static void serve_pack(struct conn *c, char *path)
+{
+	struct pack_entry *p = pack_lookup(path);
+	struct header h;
+	off_t start = 0, len;
+	int range;
+
+	if (p == NULL) {
+		send_error(c->fd, 404, "Not Found", NULL, "File not found.", c->keep);
+		log_event(LOG_REPLY, &c->peer, "File not found - ", path, NULL);
+		return;
+	}
+	if (p->status != 200) {
+		header_start(&h, p->status, "Found");
+		header_add(&h, pack_data(p->header_off), p->header_len);
+		header_end(&h, c->keep);
+		send_response(c->fd, &h, NULL, 0);
+		log_event(LOG_REPLY, &c->peer, "Directories mush end with a slash.", NULL);
+		return;
+	}
+	log_event(LOG_REPLY, &c->peer, "filesend ", path, NULL);
+	if (not_modified(c, path, p->etag, p->mtime)) return;
+	len = p->body_len;
+	if ((range = parse_range(c, p->etag, p->mtime, p->body_len, &start, &len)) < 0) {
+		send_unsatisfiable(c, p->body_len);
+		return;
 	}
+	if (range) {
+		range_header(&h, path, p->etag, p->mtime, start, len, p->body_len, c->keep);
+	} else {
+		header_start(&h, 200, "OK");
+		header_add(&h, pack_data(p->header_off), p->header_len);
+		header_end(&h, c->keep);
+	}
+	if (len > 0) {
+		start_body(c, &h, pack_fd, NULL, p->body_off + start, len);
+		// a file the live server would have cached counts as small
+		c->large = p->body_len > CACHE_MAX_FILE;
+	} else {
+		send_response(c->fd, &h, NULL, 0);
+	}
+}
 
-	getcwd(cwd, sizeof(cwd));
-	sprintf(path, "%s%s", cwd, _path);
-	fseek(f, 0, SEEK_CUR); // Force change of stream direction
+static void respond(struct conn *c) {
+	int fd = c->fd;
+	int keep = c->keep;
+	char path[4096];
+	struct stat statbuf;
+	struct cache_entry *e;
+	char pathbuf[4096];
+	int len;
 
-	if (strcasecmp(method, "GET") != 0) {
-		send_error(f, 501, "Not supported", NULL, "Method is not supported.");
-		printf("[pid %d, tid %d] Reply: %s", getpid(), gettid(), "Method is not supported.\n");
-	} else if (stat(path, &statbuf) < 0) {
-		send_error(f, 404, "Not Found", NULL, "File not found.");
-		printf("[pid %d, tid %d] Reply: File not found - %s", getpid(), gettid(), path);
+	// whatever follows a rejected request (a body, say) must not be taken for the next one
+	if (path_normalize(c->path, path, sizeof(path)) < 0) {
+		c->keep = 0;
+		send_error(fd, 400, "Bad Request", NULL, "Bad request path.", 0);
+		log_event(LOG_REPLY, &c->peer, "Bad request path.", NULL);
+	} else if (c->transfer_encoding) {
+		send_error(fd, 501, "Not supported", NULL, "Transfer-Encoding is not supported.", 0);
+		log_event(LOG_REPLY, &c->peer, "Transfer-Encoding is not supported.", NULL);
+	} else if (strcasecmp(c->method, "GET") != 0) {
+		c->keep = 0;
+		send_error(fd, 501, "Not supported", NULL, "Method is not supported.", 0);
+		log_event(LOG_REPLY, &c->peer, "Method is not supported.", NULL);
+	} else if (strcmp(path, STATS_PATH) == 0) {
+		send_stats(fd, keep);
+		log_event(LOG_REPLY, &c->peer, "stats", NULL);
+	} else if (conf.pack) {
+		serve_pack(c, path);
+	} else if (resolve(c->fd, path, &statbuf, &e) < 0) {
+		send_error(fd, 404, "Not Found", NULL, "File not found.", keep);
+		log_event(LOG_REPLY, &c->peer, "File not found - ", path, NULL);
+	} else if (e && e->type == CACHE_INDEX) {
+		cache_release(e);
+		snprintf(pathbuf, sizeof(pathbuf), "%sindex.html", path);
+		serve_file(c, pathbuf);
+		log_event(LOG_REPLY, &c->peer, "filesend ", pathbuf, NULL);
+	} else if (e) {
+		send_cached(c, e);
+		if (e->type == CACHE_LISTING) log_event(LOG_REPLY, &c->peer, "SUCCEED", NULL);
+		else log_event(LOG_REPLY, &c->peer, "filesend ", path, NULL);
+		cache_release(e);
 	} else if (S_ISDIR(statbuf.st_mode)) {
 		len = strlen(path);
 		if (len == 0 || path[len - 1] != '/') {
 			snprintf(pathbuf, sizeof(pathbuf), "Location: %s/", path);
-			send_error(f, 302, "Found", pathbuf, "Directories must end with a slash.");
-			printf("[pid %d, tid %d] Reply: %s", getpid(), gettid(), "Directories mush end with a slash.\n");
+			send_error(fd, 302, "Found", pathbuf, "Directories must end with a slash.", keep);
+			log_event(LOG_REPLY, &c->peer, "Directories mush end with a slash.", NULL);
 		} else {
-			snprintf(pathbuf, sizeof(pathbuf), "%s%sindex.html",cwd, path);
-			if (stat(pathbuf, &statbuf) >= 0) {
-				send_file(f, pathbuf, &statbuf);
-				printf("[pid %d, tid %d] Reply: filesend %s\n", getpid(), gettid(), pathbuf);
-			} else {
-				DIR *dir;
-				struct dirent *de;
-
-				send_headers(f, 200, "OK", NULL, "text/html", -1, statbuf.st_mtime);
-				fprintf(f, "<HTML><HEAD><TITLE>Index of %s</TITLE></HEAD>\r\n<BODY>", path);
-				fprintf(f, "<H4>Index of %s</H4>\r\n<PRE>\n", path);
-				fprintf(f, "Name                             Last Modified              Size\r\n");
-				fprintf(f, "<HR>\r\n");
-				if (len > 1) fprintf(f, "<A HREF=\"..\">..</A>\r\n");
-
-				dir = opendir(path);
-				while ((de = readdir(dir)) != NULL) {
-					char timebuf[32];
-					struct tm *tm;
-
-					strcpy(pathbuf, path);
-					strcat(pathbuf, de->d_name);
-
-					stat(pathbuf, &statbuf);
-					tm = gmtime(&statbuf.st_mtime);
-					strftime(timebuf, sizeof(timebuf), "%d-%b-%Y %H:%M:%S", tm);
-
-					fprintf(f, "<A HREF=\"%s%s\">", de->d_name, S_ISDIR(statbuf.st_mode) ? "/" : "");
-					fprintf(f, "%s%s", de->d_name, S_ISDIR(statbuf.st_mode) ? "/</A>" : "</A> ");
-					if (strlen(de->d_name) < 32) fprintf(f, "%*s", 32 - strlen(de->d_name), "");
-						if (S_ISDIR(statbuf.st_mode)) {
-							fprintf(f, "%s\r\n", timebuf);
-						} else {
-							fprintf(f, "%s %10d\r\n", timebuf, statbuf.st_size);
-						}
-					}
-					closedir(dir);
+			struct stat indexbuf;
 
-					fprintf(f, "</PRE>\r\n<HR>\r\n<ADDRESS>%s</ADDRESS>\r\n</BODY></HTML>\r\n", SERVER);
-							printf("[pid %d, tid %d] Reply: SUCCEED\n", getpid(), gettid());
+			snprintf(pathbuf, sizeof(pathbuf), "%sindex.html", path);
+			if (resolve(c->fd, pathbuf, &indexbuf, &e) >= 0) {
+				// remember that this directory is served by its index.html
+				cache_release(cache_put(path, &statbuf, CACHE_INDEX, NULL, 0, NULL, 0));
+				if (e) {
+					send_cached(c, e);
+					cache_release(e);
+				} else {
+					send_file(c, pathbuf, &indexbuf);
+				}
+				log_event(LOG_REPLY, &c->peer, "filesend ", pathbuf, NULL);
+			} else if ((e = render_dir(path, &statbuf)) != NULL) {
+				send_cached(c, e);
+				cache_release(e);
+				log_event(LOG_REPLY, &c->peer, "SUCCEED", NULL);
+			} else {
+				c->keep = send_dir(fd, path, &statbuf, c->http11, keep);
+				log_event(LOG_REPLY, &c->peer, "SUCCEED", NULL);
 			}
 		}
 	} else {
-			send_file(f, path, &statbuf);
-			printf("[pid %d, tid %d] Reply: filesend %s\n", getpid(), gettid(), path);
+			send_file(c, path, &statbuf);
+			log_event(LOG_REPLY, &c->peer, "filesend ", path, NULL);
 	}
+}
+
+static void request_done(struct conn *c)
+{
+	struct thread_stats *s = stats();
+	unsigned long t = now_usec() - c->started;
+
+	hist_add(c->large ? &s->service_large : &s->service_small, t);
+	s->busy_usec += t;
+	s->requests++;
+	if (c->served++ > 0) metrics_inc(keepalive_reuse);
+	request_start(c);
+	if (c->len > 0) metrics_inc(pipelined);
+}
+
+/*
+ * Take over a freshly accepted connection. Returns NULL if it was
+ * dropped. The CRASH roll is made once per connection, before any of its
+ * requests, from a seed each thread sets once.
+ */
+struct conn *conn_start(struct conn *c) {
+	static __thread unsigned int seed;
 	
-	fclose(f);
+	if (seed == 0) seed = syscall(__NR_gettid) + time(NULL);
+	if(CRASH > 0 && rand_r(&seed) % 100 < CRASH) {
+		log_event(LOG_CRASH, NULL, NULL);
+		timer_cancel(&c->deadline);
+		close(c->fd);
+		conn_put(c);
+		pthread_exit(NULL);
+	}
+
+	sleep(1); // do not change
+	metrics_inc(connections);
+
+	c->fresh = 0;
+	if (c->peer.sin_port) log_event(LOG_CONNECT, &c->peer, NULL);
+	return c;
+}
+
+struct conn *conn_open(int fd) {
+	return conn_start(conn_get(fd));
+}
+
+/*
+ * Serve requests on c until the client closes, asks to close, sits idle
+ * for KEEPALIVE_TIMEOUT or has used up KEEPALIVE_MAX requests, then close
+ * it and return 0. Requests the client pipelined are already in the
+ * connection buffer and are parsed without another read().
+ *
+ * Every wait on the client is bounded by the connection's deadline: a
+ * request head must arrive whole within REQUEST_TIMEOUT however slowly
+ * it trickles in, and a response must be taken within WRITE_TIMEOUT plus
+ * the time MIN_SEND_RATE allows for its body. A slow client can hold a
+ * worker that long and no longer.
+ *
+ * With slice set, a body streamed from disk gives up the thread after
+ * every SLICE_BYTES and 1 is returned; the caller queues the connection
+ * and later calls conn_serve() again to carry on where it stopped. 2 is
+ * returned instead when the rate limits hold the body back: the caller is
+ * to carry on no sooner than c->pace_wait usec later. Nor does a sliced
+ * connection wait for its client to send: if a request head is not all
+ * there yet, 3 is returned and the caller is to carry on once the socket
+ * is readable. The deadline keeps running meanwhile; when it fires it
+ * shuts the socket down, which makes it readable too.
+ */
+int conn_serve(struct conn *c, int slice) {
+	int fd = c->fd;
+	int r, n = 0;
+	unsigned long long t;
+
+	if (c->body_fd >= 0) {
+		if ((r = send_body(c, slice)) != 0) return r;
+		request_done(c);
+		if (c->expired) metrics_inc(slow_write);
+	}
+
+	// a connection back from waiting for its client reads on even if its deadline fired meanwhile
+	while (c->waiting || (c->keep && c->served < KEEPALIVE_MAX && !c->expired)) {
+		t = trace_now();
+		if (c->waiting) {
+			// the deadline was stopped while the connection queued for a worker, which is not the client's doing
+			if (!c->expired) timer_arm(&c->deadline, c->left);
+		} else {
+			// between requests the client gets KEEPALIVE_TIMEOUT to start the next one
+			c->idle = c->served > 0 && c->len == 0;
+			timer_arm(&c->deadline, (c->idle ? KEEPALIVE_TIMEOUT : REQUEST_TIMEOUT) * 1000);
+		}
+		c->waiting = 0;
+		while ((r = request_parse(c)) == 0 && (n = conn_fill(c, slice ? MSG_DONTWAIT : 0)) > 0) {
+			if (c->idle) timer_arm(&c->deadline, REQUEST_TIMEOUT * 1000);
+			c->idle = 0;
+		}
+		if (r == 0 && n < 0 && errno == EAGAIN) {
+			c->waiting = 1;
+			trace_span(TRACE_READ, fd, t);
+			return 3;
+		}
+		timer_cancel(&c->deadline);
+		trace_span(TRACE_READ, fd, t);
+		if (c->expired) {
+			if (c->idle) metrics_inc(keepalive_timeout);
+			else metrics_inc(slow_read);
+			break;
+		}
+		if (r == -2) {
+			send_error(fd, 414, "URI Too Long", NULL, "Request path too long.", 0);
+			break;
+		}
+		if (r < 0) {
+			send_error(fd, 400, "Bad Request", NULL, "Malformed request.", 0);
+			break;
+		}
+		if (r == 0) {
+			if (n < 0 && errno == ENOBUFS)
+				send_error(fd, 431, "Request Header Fields Too Large", NULL, "Request header too large.", 0);
+			break;
+		}
+		c->started = now_usec();
+
+		log_event(LOG_URL, &c->peer, c->method, " ", c->path, " ", c->protocol, NULL);
+
+		timer_arm(&c->deadline, WRITE_TIMEOUT * 1000);
+		respond(c);
+		timer_cancel(&c->deadline);
+
+		if (c->body_fd >= 0 && (r = send_body(c, slice)) != 0) return r;
+		request_done(c);
+		if (c->expired) metrics_inc(slow_write);
+	}
+
+	t = trace_now();
+	close(fd);
+	conn_put(c);
+	trace_span(TRACE_CLOSE, fd, t);
 	return 0;
 }
 
+int process(int fd) {
+	struct conn *c = conn_open(fd);
 
+	if (c) conn_serve(c, 0);
+	return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "config.h"
+#include "metrics.h"
+#include "http.h"
+#include "pace.h"
+
+/*
+ * Bandwidth limits for bodies streamed from disk (-g, -i, -s): one
+ * bucket for the whole server, one per client address shared by all its
+ * connections, and one per connection. A chunk is paid for in every
+ * bucket that is limited before it is sent, so it goes out no faster than
+ * the tightest of them allows. Bodies sent from memory are small and are
+ * not paced.
+ *
+ * webserver_multi parks a connection that has to wait on the timer wheel
+ * and frees its worker; the wheel fires up to two ticks late, which the
+ * PACE_BURST a bucket saves up meanwhile makes good. webserver has no
+ * other connection to turn to and sleeps instead.
+ */
+static struct bucket global;
+static struct pace_client *clients[PACE_BUCKETS];
+static pthread_mutex_t pace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int pacing()
+{
+	return conf.rate || conf.client_rate || conf.conn_rate;
+}
+
+// Credit b with what rate earned since its last refill, take n and return the usec to wait for it.
+// A bucket not used before starts full.
+static unsigned long bucket_take(struct bucket *b, long rate, unsigned long n, unsigned long long now)
+{
+	double burst = rate * PACE_BURST / 1000.0;
+
+	if (b->last == 0) {
+		b->tokens = burst;
+	} else {
+		b->tokens += (now - b->last) * rate / 1e6;
+		if (b->tokens > burst) b->tokens = burst;
+	}
+	b->last = now;
+	b->tokens -= n;
+	return b->tokens < 0 ? -b->tokens * 1e6 / rate : 0;
+}
+
+// Find or add the entry for addr. Called with pace_lock held.
+static struct pace_client *client_get(in_addr_t addr, unsigned long long now)
+{
+	struct pace_client **pp = &clients[addr % PACE_BUCKETS];
+	struct pace_client *p;
+
+	while ((p = *pp) != NULL) {
+		if (p->addr == addr) {
+			p->refs++;
+			return p;
+		}
+		// an idle client is forgotten once it has paid off what it owed
+		if (p->refs == 0 && p->b.tokens + (now - p->b.last) * conf.client_rate / 1e6 >= 0) {
+			*pp = p->next;
+			free(p);
+		} else {
+			pp = &p->next;
+		}
+	}
+	p = calloc(1, sizeof(*p));
+	p->addr = addr;
+	p->refs = 1;
+	p->next = clients[addr % PACE_BUCKETS];
+	clients[addr % PACE_BUCKETS] = p;
+	return p;
+}
+
+/*
+ * Pay for the next n body bytes of c in every limited bucket. Returns
+ * how many usec the caller must wait before sending them, 0 to go ahead.
+ */
+unsigned long pace_take(struct conn *c, unsigned long n)
+{
+	unsigned long long now = now_usec();
+	unsigned long wait = 0, w;
+
+	if (conf.conn_rate) wait = bucket_take(&c->pace, conf.conn_rate, n, now);
+	if (conf.rate || conf.client_rate) {
+		pthread_mutex_lock(&pace_lock);
+		if (conf.rate && (w = bucket_take(&global, conf.rate, n, now)) > wait) wait = w;
+		if (conf.client_rate) {
+			if (c->client == NULL) c->client = client_get(c->peer.sin_addr.s_addr, now);
+			if ((w = bucket_take(&c->client->b, conf.client_rate, n, now)) > wait) wait = w;
+		}
+		pthread_mutex_unlock(&pace_lock);
+	}
+	if (wait) {
+		metrics_inc(throttled);
+		metrics_add(throttled_bytes, n);
+		metrics_add(throttled_usec, wait);
+	}
+	return wait;
+}
+
+void pace_sleep(unsigned long usec)
+{
+	struct timespec ts = { usec / 1000000, usec % 1000000 * 1000 };
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// c has no body in flight any more; drop its hold on its client's bucket.
+void pace_done(struct conn *c)
+{
+	if (c->client == NULL) return;
+	pthread_mutex_lock(&pace_lock);
+	c->client->refs--;
+	pthread_mutex_unlock(&pace_lock);
+	c->client = NULL;
+}
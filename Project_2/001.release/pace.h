@@ -0,0 +1,36 @@
+#ifndef __PACE
+#define __PACE
+
+#include <netinet/in.h>
+#include "timer.h"
+
+#define PACE_CHUNK (64 * 1024) // most bytes paid for and sent in one go while pacing
+#define PACE_BURST (2 * TIMER_TICK) // ms of its rate a bucket can save up, what a parked body may oversleep
+#define PACE_BUCKETS 256 // hash chains of the per-client table
+
+/*
+ * Token bucket. tokens may go negative: a sender takes what it is about
+ * to send and then waits off the debt, so concurrent senders on one
+ * bucket are served in the order they paid.
+ */
+struct bucket {
+	double tokens; // bytes
+	unsigned long long last; // now_usec() of the last refill
+};
+
+// The bucket every connection from one client address draws on.
+struct pace_client {
+	in_addr_t addr;
+	struct bucket b;
+	int refs; // connections with a body in flight
+	struct pace_client *next;
+};
+
+struct conn;
+
+int pacing();
+unsigned long pace_take(struct conn *c, unsigned long n);
+void pace_sleep(unsigned long usec);
+void pace_done(struct conn *c);
+
+#endif
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pack.h"
+
+int pack_fd = -1;
+
+static char *map;
+static struct pack_header *head;
+static uint32_t *disp;
+static struct pack_entry *slots;
+
+// Map a pack built by mkpack. Only the header is checked, whatever the number of files.
+int pack_open(const char *file)
+{
+	struct stat st;
+
+	if ((pack_fd = open(file, O_RDONLY | O_CLOEXEC)) < 0 || fstat(pack_fd, &st) < 0) {
+		perror("Failed to open pack");
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, pack_fd, 0);
+	if (map == MAP_FAILED) {
+		perror("Failed to map pack");
+		return -1;
+	}
+	head = (struct pack_header *) map;
+	if (st.st_size < sizeof(*head) || memcmp(head->magic, PACK_MAGIC, 8) != 0 || head->size != st.st_size
+			|| sizeof(*head) + head->buckets * 4ULL + head->slots * (unsigned long long) sizeof(*slots) > st.st_size) {
+		fprintf(stderr, "%s: not a pack or truncated\n", file);
+		return -1;
+	}
+	disp = (uint32_t *) (map + sizeof(*head));
+	slots = (struct pack_entry *) (disp + head->buckets);
+	return 0;
+}
+
+struct pack_entry *pack_lookup(const char *path)
+{
+	int len = strlen(path);
+	struct pack_entry *e;
+
+	if (head->slots == 0) return NULL;
+	e = &slots[pack_hash(path, len, disp[pack_hash(path, len, 0) % head->buckets]) % head->slots];
+	// a path that is not in the pack still hashes to some slot
+	if (e->key_len != len || memcmp(map + e->key_off, path, len) != 0) return NULL;
+	return e;
+}
+
+char *pack_data(uint64_t off)
+{
+	return map + off;
+}
@@ -0,0 +1,62 @@
+#ifndef __PACK
+#define __PACK
+
+#include <stdint.h>
+#include "header.h"
+
+#define PACK_MAGIC "WSPACK1"
+#define PACK_ALIGN 4096 // bodies start on page boundaries
+#define PACK_BUCKET 4 // average keys per hash bucket when building the index
+
+/*
+ * A pack is a document tree frozen into one file by mkpack:
+ *
+ *	struct pack_header
+ *	uint32_t disp[buckets]		displacement per bucket
+ *	struct pack_entry slots[slots]	one per URL path
+ *	keys and header blocks
+ *	bodies, each PACK_ALIGN aligned
+ *
+ * The index is a perfect hash (hash and displace): a path's bucket is
+ * pack_hash(path, 0) % buckets and its slot pack_hash(path, disp[bucket])
+ * % slots, so a lookup is two hashes and one key compare. Nothing is
+ * parsed when the server starts, it just maps the file.
+ */
+struct pack_header {
+	char magic[8];
+	uint32_t buckets;
+	uint32_t slots;
+	uint64_t size; // of the whole file, to catch truncation
+};
+
+struct pack_entry {
+	uint64_t key_off;
+	uint64_t header_off; // everything between the status line and Connection
+	uint64_t body_off;
+	uint64_t body_len;
+	int64_t mtime;
+	uint32_t key_len; // 0 for an unused slot
+	uint32_t header_len;
+	uint32_t status; // 200, or 302 for a directory named without its slash
+	uint32_t unused;
+	char etag[ETAG_LEN];
+};
+
+extern int pack_fd;
+
+static inline uint32_t pack_hash(const char *key, int len, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+	while (len-- > 0) {
+		h ^= (unsigned char) *key++;
+		h *= 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+int pack_open(const char *file);
+struct pack_entry *pack_lookup(const char *path);
+char *pack_data(uint64_t off);
+
+#endif
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "scenario.h"
+
+#define LINE_MAX_LEN 4096
+#define SEEN_BUCKETS (1 << 16)
+
+struct scenario scen;
+
+/*
+ * Scenario file, one directive per line, # starts a comment:
+ *
+ *	url PATH [CLASS]                 add a URL, to class "default" unless named
+ *	range PATTERN FIRST LAST [CLASS] add PATTERN with %d replaced by FIRST .. LAST
+ *	weight CLASS SHARE               share of requests that go to CLASS
+ *	zipf S                           popularity of the n-th URL in its class ~ 1/n^S
+ *	think none|const|exp MS          pause after each response before the connection is reused
+ *	ramp SECONDS FROM TO             rate climbs (or falls) linearly from FROM to TO req/s
+ *	steady SECONDS RATE
+ *	spike SECONDS RATE
+ *
+ * Phases run in the order given. URLs within a class are ranked by the
+ * order they are listed in.
+ */
+static int class_find(char *name)
+{
+	int i;
+
+	for (i = 0; i < scen.nclasses; i++)
+		if (strcmp(scen.classes[i].name, name) == 0) return i;
+	if (scen.nclasses == MAX_CLASS) return -1;
+	snprintf(scen.classes[i].name, CLASS_NAME, "%s", name);
+	scen.classes[i].weight = -1;
+	return scen.nclasses++;
+}
+
+static int url_add(char *path, char *class)
+{
+	int c = class_find(class ? class : "default");
+
+	if (c < 0) {
+		fprintf(stderr, "more than %d URL classes\n", MAX_CLASS);
+		return -1;
+	}
+	if ((scen.nurls & (scen.nurls - 1)) == 0)
+		scen.urls = realloc(scen.urls, (scen.nurls ? scen.nurls * 2 : 1) * sizeof(struct url));
+	scen.urls[scen.nurls].path = strdup(path);
+	scen.urls[scen.nurls].class = c;
+	return scen.nurls++;
+}
+
+static int phase_add(char *name, double seconds, double from, double to)
+{
+	struct phase *p = &scen.phases[scen.nphases];
+
+	if (scen.nphases == MAX_PHASE || seconds <= 0 || from < 0 || to < 0) return -1;
+	snprintf(p->name, CLASS_NAME, "%s", name);
+	p->seconds = seconds;
+	p->from = from;
+	p->to = to;
+	scen.seconds += seconds;
+	scen.nphases++;
+	return 0;
+}
+
+// pattern with its %d replaced by n. Returns -1 if %d is not its one conversion.
+static int range_path(char *buf, int size, char *pattern, int n)
+{
+	char *p = strchr(pattern, '%');
+
+	if (p == NULL || p[1] != 'd' || strchr(p + 2, '%')) return -1;
+	snprintf(buf, size, "%.*s%d%s", (int) (p - pattern), pattern, n, p + 2);
+	return 0;
+}
+
+int scenario_load(char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[LINE_MAX_LEN], buf[LINE_MAX_LEN], *w[6], *p;
+	int n, i, lineno = 0, c, first, last;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL) *p = '\0';
+		for (n = 0, p = strtok(line, " \t\r\n"); p && n < 6; p = strtok(NULL, " \t\r\n")) w[n++] = p;
+		if (n == 0) continue;
+
+		if (strcmp(w[0], "url") == 0 && (n == 2 || n == 3)) {
+			if (url_add(w[1], n == 3 ? w[2] : NULL) < 0) goto bad;
+		} else if (strcmp(w[0], "range") == 0 && (n == 4 || n == 5)) {
+			first = atoi(w[2]);
+			last = atoi(w[3]);
+			for (i = first; i <= last; i++) {
+				if (range_path(buf, sizeof(buf), w[1], i) < 0) goto bad;
+				if (url_add(buf, n == 5 ? w[4] : NULL) < 0) goto bad;
+			}
+		} else if (strcmp(w[0], "weight") == 0 && n == 3) {
+			if ((c = class_find(w[1])) < 0 || atof(w[2]) < 0) goto bad;
+			scen.classes[c].weight = atof(w[2]);
+		} else if (strcmp(w[0], "zipf") == 0 && n == 2) {
+			scen.zipf = atof(w[1]);
+		} else if (strcmp(w[0], "think") == 0 && n >= 2) {
+			if (strcmp(w[1], "none") == 0) scen.think = THINK_NONE;
+			else if (strcmp(w[1], "const") == 0 && n == 3) scen.think = THINK_CONST;
+			else if (strcmp(w[1], "exp") == 0 && n == 3) scen.think = THINK_EXP;
+			else goto bad;
+			scen.think_ms = n == 3 ? atof(w[2]) : 0;
+		} else if (strcmp(w[0], "ramp") == 0 && n == 4) {
+			if (phase_add(w[0], atof(w[1]), atof(w[2]), atof(w[3])) < 0) goto bad;
+		} else if ((strcmp(w[0], "steady") == 0 || strcmp(w[0], "spike") == 0) && n == 3) {
+			if (phase_add(w[0], atof(w[1]), atof(w[2]), atof(w[2])) < 0) goto bad;
+		} else {
+			goto bad;
+		}
+	}
+	fclose(f);
+	if (scen.nurls == 0 || scen.nphases == 0) {
+		fprintf(stderr, "%s: needs at least one url and one phase\n", path);
+		return -1;
+	}
+	// a class given a weight but no URLs would be picked with nothing in it
+	for (c = 0; c < scen.nclasses; c++) {
+		for (i = 0; i < scen.nurls && scen.urls[i].class != c; i++);
+		if (i == scen.nurls) {
+			fprintf(stderr, "%s: class %s has no urls\n", path, scen.classes[c].name);
+			return -1;
+		}
+	}
+	// a class left at its default weight has URLs, so only all weights given as 0 leave nothing to pick
+	for (c = 0; c < scen.nclasses && scen.classes[c].weight == 0; c++);
+	if (c == scen.nclasses) {
+		fprintf(stderr, "%s: every class has weight 0\n", path);
+		return -1;
+	}
+	return 0;
+bad:
+	fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+	fclose(f);
+	return -1;
+}
+
+// One URL at a constant rate, what the command line alone asks for.
+void scenario_default(char *page, double rate, int seconds)
+{
+	url_add(page, NULL);
+	phase_add("steady", seconds, rate, rate);
+}
+
+/*
+ * Replay the GETs of an access log. Common/combined log format lines
+ * carry a timestamp and are sent as far apart as they were recorded,
+ * divided by speed; lines without one (the server's own log) are sent
+ * at rate. Replayed URLs are classed by extension; once MAX_CLASS - 1
+ * extensions are in use, further ones join "other".
+ */
+static unsigned int path_hash(char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s) h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+int replay_load(char *path, double speed, double rate)
+{
+	FILE *f = fopen(path, "r");
+	char line[LINE_MAX_LEN], class[CLASS_NAME], *p, *q, *ext, *slash;
+	int *seen = malloc(SEEN_BUCKETS * sizeof(int));
+	int size = 0, timed = 1, i, j, k, c;
+	unsigned int h;
+	struct tm tm;
+	time_t t, t0 = 0;
+
+	if (f == NULL) {
+		perror(path);
+		free(seen);
+		return -1;
+	}
+	memset(seen, -1, SEEN_BUCKETS * sizeof(int));
+	while (fgets(line, sizeof(line), f)) {
+		if ((p = strstr(line, "GET ")) == NULL) continue;
+		p += 4;
+		if ((q = strpbrk(p, " \"\r\n")) == NULL) continue;
+		*q = '\0';
+		if (*p != '/') continue;
+
+		if (scen.nreplay == size) {
+			size = size ? size * 2 : 1024;
+			scen.replay = realloc(scen.replay, size * sizeof(struct replay));
+		}
+		// [10/Oct/2000:13:55:36 -0700]
+		memset(&tm, 0, sizeof(tm));
+		if (timed && (q = strchr(line, '[')) != NULL && q < p && strptime(q + 1, "%d/%b/%Y:%H:%M:%S", &tm)) {
+			t = timegm(&tm);
+			if (scen.nreplay == 0) t0 = t;
+			scen.replay[scen.nreplay].at = (t - t0) / speed;
+		} else {
+			timed = 0;
+		}
+
+		// open addressing on the path, the same URL is kept once
+		for (h = path_hash(p) & (SEEN_BUCKETS - 1); seen[h] >= 0; h = (h + 1) & (SEEN_BUCKETS - 1))
+			if (strcmp(scen.urls[seen[h]].path, p) == 0) break;
+		if (seen[h] < 0 && scen.nurls < SEEN_BUCKETS / 2) {
+			q = strchr(p, '?');
+			if (q) *q = '\0';
+			slash = strrchr(p, '/');
+			ext = strrchr(slash, '.');
+			snprintf(class, sizeof(class), "%s", ext ? ext + 1 : slash[1] ? "other" : "dir");
+			if (q) *q = '?';
+			// the last class slot is kept for "other"
+			for (c = 0; c < scen.nclasses && strcmp(scen.classes[c].name, class) != 0; c++);
+			if (c == scen.nclasses && c >= MAX_CLASS - 1) snprintf(class, sizeof(class), "other");
+			seen[h] = url_add(p, class);
+		}
+		if (seen[h] < 0) continue; // too many distinct URLs, the rest is skipped
+		scen.replay[scen.nreplay++].url = seen[h];
+	}
+	fclose(f);
+	free(seen);
+	if (scen.nreplay == 0) {
+		fprintf(stderr, "%s: no GET requests found\n", path);
+		return -1;
+	}
+	if (!timed) {
+		for (i = 0; i < scen.nreplay; i++) scen.replay[i].at = i / rate;
+	} else {
+		// timestamps only have whole seconds: spread each second's requests across it
+		for (i = 0; i < scen.nreplay; i = j) {
+			for (j = i + 1; j < scen.nreplay && scen.replay[j].at == scen.replay[i].at; j++);
+			for (k = i; k < j; k++) scen.replay[k].at += (double) (k - i) / (j - i) / speed;
+		}
+	}
+	for (i = 0; i < scen.nreplay; i++)
+		if (scen.replay[i].at >= scen.seconds) scen.seconds = scen.replay[i].at + 1e-9;
+	return 0;
+}
+
+/*
+ * Group the URLs by class, keeping their order within it, and build the
+ * popularity tables and the request each URL is sent with. A replay
+ * keeps its URLs where they are, its records point at them.
+ */
+void scenario_finish(char *host, char *agent)
+{
+	static const char tpl[] = "GET %s%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\n\r\n";
+	struct url_class *c;
+	struct url *u, *sorted;
+	double sum = 0;
+	int i, j, n = 0;
+
+	if (scen.replay == NULL) {
+		sorted = malloc(scen.nurls * sizeof(struct url));
+		for (i = 0; i < scen.nclasses; i++) {
+			scen.classes[i].first = n;
+			for (j = 0; j < scen.nurls; j++)
+				if (scen.urls[j].class == i) sorted[n++] = scen.urls[j];
+			scen.classes[i].count = n - scen.classes[i].first;
+		}
+		free(scen.urls);
+		scen.urls = sorted;
+	}
+	for (i = 0; i < scen.nurls; i++) {
+		u = &scen.urls[i];
+		u->len = snprintf(NULL, 0, tpl, u->path[0] == '/' ? "" : "/", u->path, host, agent);
+		u->request = malloc(u->len + 1);
+		snprintf(u->request, u->len + 1, tpl, u->path[0] == '/' ? "" : "/", u->path, host, agent);
+	}
+	for (i = 0; i < scen.nclasses; i++) {
+		c = &scen.classes[i];
+		if (c->weight < 0 || c->count == 0) c->weight = c->count;
+		sum += c->weight;
+		scen.class_cdf[i] = sum;
+		c->cdf = malloc(c->count * sizeof(double));
+		for (j = 0; j < c->count; j++)
+			c->cdf[j] = (j ? c->cdf[j - 1] : 0) + pow(j + 1, -scen.zipf);
+	}
+	for (i = 0; i < scen.nclasses; i++) scen.class_cdf[i] /= sum;
+}
+
+void scenario_print(FILE *f)
+{
+	struct phase *p;
+	int i;
+
+	if (scen.replay) {
+		fprintf(f, "replay:      %d requests for %d URLs over %.1f s\n", scen.nreplay, scen.nurls, scen.seconds);
+		return;
+	}
+	fprintf(f, "urls:        %d in %d class%s, zipf %g", scen.nurls, scen.nclasses, scen.nclasses > 1 ? "es" : "", scen.zipf);
+	if (scen.think == THINK_CONST) fprintf(f, ", think %g ms", scen.think_ms);
+	else if (scen.think == THINK_EXP) fprintf(f, ", think exp(%g ms)", scen.think_ms);
+	fprintf(f, "\nphases:     ");
+	for (i = 0; i < scen.nphases; i++) {
+		p = &scen.phases[i];
+		fprintf(f, "%s %s %g s ", i ? "," : "", p->name, p->seconds);
+		if (p->from != p->to) fprintf(f, "%g -> %g req/s", p->from, p->to);
+		else fprintf(f, "%g req/s", p->from);
+	}
+	fprintf(f, "\n");
+}
+
+/*
+ * The time, in seconds from the start, by which need more requests have
+ * come due after t, or -1 if the phases end first. Within a phase the
+ * rate is r + k * x, so requests add up as r * x + k * x^2 / 2.
+ */
+double scenario_advance(double t, double need)
+{
+	struct phase *p;
+	double begin = 0, end, k, r, span, room;
+	int i;
+
+	for (i = 0; i < scen.nphases; i++, begin = end) {
+		p = &scen.phases[i];
+		end = begin + p->seconds;
+		if (t >= end) continue;
+		if (t < begin) t = begin;
+		k = (p->to - p->from) / p->seconds;
+		r = p->from + k * (t - begin);
+		span = end - t;
+		room = r * span + k * span * span / 2;
+		if (room < need) {
+			need -= room;
+			continue;
+		}
+		if (fabs(k) < 1e-9) return t + need / r;
+		return t + (sqrt(fmax(r * r + 2 * k * need, 0)) - r) / k;
+	}
+	return -1;
+}
+
+// xorshift64*, uniform in [0, 1)
+double rng_next(unsigned long long *rng)
+{
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return (*rng * 2685821657736338717ULL >> 11) * (1.0 / (1ULL << 53));
+}
+
+// A class by weight, then a URL in it by popularity.
+int scenario_pick(unsigned long long *rng)
+{
+	struct url_class *c;
+	double u = rng_next(rng);
+	int lo = 0, hi, mid;
+
+	while (lo < scen.nclasses - 1 && scen.class_cdf[lo] <= u) lo++;
+	c = &scen.classes[lo];
+	u = rng_next(rng) * c->cdf[c->count - 1];
+	for (lo = 0, hi = c->count - 1; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (c->cdf[mid] <= u) lo = mid + 1;
+		else hi = mid;
+	}
+	return c->first + lo;
+}
+
+// Milliseconds a connection pauses before its next request.
+double scenario_think(unsigned long long *rng)
+{
+	if (scen.think == THINK_CONST) return scen.think_ms;
+	if (scen.think == THINK_EXP) return -scen.think_ms * log(1 - rng_next(rng));
+	return 0;
+}
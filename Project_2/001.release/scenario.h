@@ -0,0 +1,67 @@
+#ifndef __SCENARIO
+#define __SCENARIO
+
+#define MAX_CLASS 16
+#define MAX_PHASE 32
+#define CLASS_NAME 32
+
+enum { THINK_NONE, THINK_CONST, THINK_EXP };
+
+struct url {
+	char *path;
+	char *request; // the whole GET, built once
+	int len;
+	int class;
+};
+
+struct url_class {
+	char name[CLASS_NAME];
+	double weight; // share of requests, by default the number of URLs in the class
+	int first, count; // its URLs are urls[first] .. urls[first + count - 1], most popular first
+	double *cdf; // Zipf popularity over them
+};
+
+struct phase {
+	char name[CLASS_NAME];
+	double seconds;
+	double from, to; // req/s at the start and at the end of the phase
+};
+
+struct replay {
+	double at; // seconds after the start
+	int url;
+};
+
+/*
+ * What the client sends and when. Either a URL mix drawn at random at a
+ * rate that follows the phases, or a recorded log played back in order.
+ */
+struct scenario {
+	struct url *urls;
+	int nurls;
+	struct url_class classes[MAX_CLASS];
+	int nclasses;
+	double class_cdf[MAX_CLASS];
+	double zipf; // popularity skew within a class, 0 for uniform
+	int think; // THINK_*
+	double think_ms; // mean pause a connection takes after each response
+	struct phase phases[MAX_PHASE];
+	int nphases;
+	double seconds; // length of the whole run
+	struct replay *replay;
+	int nreplay;
+};
+
+extern struct scenario scen;
+
+int scenario_load(char *path);
+int replay_load(char *path, double speed, double rate);
+void scenario_default(char *page, double rate, int seconds);
+void scenario_finish(char *host, char *agent);
+void scenario_print(FILE *f);
+double scenario_advance(double t, double need);
+int scenario_pick(unsigned long long *rng);
+double scenario_think(unsigned long long *rng);
+double rng_next(unsigned long long *rng);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "timer.h"
+
+/*
+ * Hierarchical timing wheel. Level 0 has one slot per tick for the next
+ * WHEEL_SIZE ticks; each higher level has slots WHEEL_SIZE times as wide.
+ * Arming and cancelling are a list insert and unlink, O(1) whatever the
+ * number of timers. When level 0 wraps, the next slot of level 1 is
+ * spread over level 0, and so on up.
+ */
+static struct timer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static unsigned long now_tick;
+static unsigned long long started;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called with wheel_lock held.
+static void wheel_add(struct timer *t)
+{
+	unsigned long delta = t->expires - now_tick;
+	struct timer **slot;
+	int level;
+
+	if ((long) delta < 0) {
+		t->expires = now_tick;
+		delta = 0;
+	}
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1UL << (WHEEL_BITS * (level + 1))) break;
+	if (delta >= 1UL << (WHEEL_BITS * WHEEL_LEVELS)) t->expires = now_tick + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	slot = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+	t->next = *slot;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void wheel_del(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->pprev = NULL;
+}
+
+void timer_arm(struct timer *t, int ms)
+{
+	pthread_mutex_lock(&wheel_lock);
+	if (t->pprev) wheel_del(t);
+	// round up, a deadline may fire late by a tick but never early
+	t->expires = now_tick + (ms + TIMER_TICK - 1) / TIMER_TICK + 1;
+	wheel_add(t);
+	pthread_mutex_unlock(&wheel_lock);
+}
+
+int timer_cancel(struct timer *t)
+{
+	int ms = 0;
+
+	pthread_mutex_lock(&wheel_lock);
+	if (t->pprev) {
+		wheel_del(t);
+		ms = (t->expires - now_tick) * TIMER_TICK;
+	}
+	pthread_mutex_unlock(&wheel_lock);
+	return ms;
+}
+
+// Move every timer in the current slot of level into lower levels.
+static void cascade(int level)
+{
+	struct timer *t = wheel[level][(now_tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+	struct timer *next;
+
+	wheel[level][(now_tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		wheel_add(t);
+	}
+}
+
+static void tick()
+{
+	struct timer *t;
+	int level;
+
+	now_tick++;
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (now_tick & ((1UL << (WHEEL_BITS * level)) - 1)) break;
+		cascade(level);
+	}
+	while ((t = wheel[0][now_tick & (WHEEL_SIZE - 1)]) != NULL) {
+		wheel_del(t);
+		t->fn(t);
+	}
+}
+
+static void *timer_thread(void *arg)
+{
+	unsigned long target;
+
+	while (1) {
+		usleep(TIMER_TICK * 1000);
+		// catch up on ticks lost to scheduling delays
+		target = (now_usec() - started) / (TIMER_TICK * 1000);
+		pthread_mutex_lock(&wheel_lock);
+		while (now_tick < target) tick();
+		pthread_mutex_unlock(&wheel_lock);
+	}
+	return NULL;
+}
+
+void timer_init()
+{
+	pthread_t tid;
+	sigset_t all, old;
+
+	started = now_usec();
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_create(&tid, NULL, timer_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_detach(tid);
+}
@@ -0,0 +1,26 @@
+#ifndef __TIMER
+#define __TIMER
+
+#define TIMER_TICK 100 // ms per tick of the wheel
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks, about 19 days, before a timer has to be clamped
+
+/*
+ * A timer is embedded in whatever it times out. fn runs on the timer
+ * thread with the wheel locked: it must be quick, must not block and
+ * must not arm or cancel timers. Once timer_cancel() returns, fn is
+ * either finished or will not run, so the owner may free the timer; it
+ * returns the ms the timer had left, 0 if it was not armed.
+ */
+struct timer {
+	unsigned long expires; // in ticks
+	struct timer *next, **pprev; // pprev is NULL while not armed
+	void (*fn)(struct timer *t);
+};
+
+void timer_init();
+void timer_arm(struct timer *t, int ms);
+int timer_cancel(struct timer *t);
+
+#endif
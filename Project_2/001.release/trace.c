@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "webserver.h"
+#include "metrics.h"
+#include "trace.h"
+
+int tracing = 0;
+
+static const char *phase_names[] = {
+	"accept", "enqueue", "dequeue", "read", "resolve", "header", "body", "close",
+};
+
+struct span {
+	unsigned long long start, end; // trace_clock() ticks
+	int phase;
+	int fd;
+};
+
+// Spans are only appended by the owning thread; count is published last.
+struct trace_buf {
+	int tid;
+	int count;
+	int dropped;
+	int orphan; // owner exited; the next thread to trace takes it over
+	struct span spans[TRACE_SPANS];
+	struct trace_buf *next;
+};
+
+static struct trace_buf *bufs;
+static pthread_mutex_t bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_buf *my_buf;
+static pthread_key_t buf_key;
+static pthread_once_t buf_once = PTHREAD_ONCE_INIT;
+
+// Pairs of clock ticks and microseconds, to convert ticks when dumping.
+static unsigned long long base_ticks, base_usec;
+
+void trace_init()
+{
+	base_ticks = trace_clock();
+	base_usec = now_usec();
+	tracing = 1;
+}
+
+static void buf_orphan(void *arg)
+{
+	struct trace_buf *b = arg;
+
+	__atomic_store_n(&b->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static void buf_key_init()
+{
+	pthread_key_create(&buf_key, buf_orphan);
+}
+
+/*
+ * Give the calling thread a span buffer. Like the counter blocks in
+ * metrics.c they are never freed: one left by an exited thread is taken
+ * over with the spans it holds, so respawned and rescaled workers do not
+ * add a buffer each. The taker keeps appending to the old thread's lane.
+ */
+static struct trace_buf *buf_attach()
+{
+	struct trace_buf *b;
+
+	pthread_once(&buf_once, buf_key_init);
+	pthread_mutex_lock(&bufs_lock);
+	for (b = bufs; b; b = b->next)
+		if (__atomic_load_n(&b->orphan, __ATOMIC_ACQUIRE)) break;
+	if (b == NULL) {
+		b = calloc(1, sizeof(*b));
+		b->tid = gettid();
+		b->next = bufs;
+		bufs = b;
+	}
+	b->orphan = 0;
+	pthread_mutex_unlock(&bufs_lock);
+
+	pthread_setspecific(buf_key, b);
+	my_buf = b;
+	return b;
+}
+
+void trace_record(int phase, int fd, unsigned long long start)
+{
+	struct trace_buf *b = my_buf;
+	struct span *s;
+
+	if (b == NULL) b = buf_attach();
+	if (b->count == TRACE_SPANS) {
+		b->dropped++;
+		return;
+	}
+	s = &b->spans[b->count];
+	s->end = trace_clock();
+	s->start = start ? start : s->end; // 0 for an instant event
+	s->phase = phase;
+	s->fd = fd;
+	__atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write every span recorded so far as Chrome trace events ("X" complete
+ * events, accept as an instant), viewable in chrome://tracing or
+ * Perfetto. Threads may still be running; what they add meanwhile is
+ * left out.
+ */
+void trace_dump(char *path)
+{
+	double per_usec = (double) (trace_clock() - base_ticks) / (now_usec() - base_usec + 1);
+	struct trace_buf *b;
+	struct span *s;
+	FILE *f = fopen(path, "w");
+	int pid = getpid();
+	int i, n, first = 1, dropped = 0;
+
+	if (f == NULL) {
+		perror("Failed to write trace");
+		return;
+	}
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	pthread_mutex_lock(&bufs_lock);
+	for (b = bufs; b; b = b->next) {
+		n = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+		dropped += b->dropped;
+		for (i = 0; i < n; i++) {
+			s = &b->spans[i];
+			fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"%s\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, ",
+				first ? "" : ",", phase_names[s->phase], s->phase == TRACE_ACCEPT ? "i" : "X",
+				pid, b->tid, (long long) (s->start - base_ticks) / per_usec);
+			if (s->phase == TRACE_ACCEPT) fprintf(f, "\"s\": \"t\", ");
+			else fprintf(f, "\"dur\": %.3f, ", (s->end - s->start) / per_usec);
+			fprintf(f, "\"args\": {\"fd\": %d}}", s->fd);
+			first = 0;
+		}
+	}
+	pthread_mutex_unlock(&bufs_lock);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	printf("[pid %d] trace written to %s, %d spans dropped\n", pid, path, dropped);
+}
@@ -0,0 +1,39 @@
+#ifndef __TRACE
+#define __TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define trace_clock() __rdtsc()
+#else
+unsigned long long now_usec();
+#define trace_clock() now_usec()
+#endif
+
+#define TRACE_SPANS (1 << 15) // per thread; later spans are dropped
+
+enum {
+	TRACE_ACCEPT,
+	TRACE_ENQUEUE,
+	TRACE_DEQUEUE,
+	TRACE_READ,
+	TRACE_RESOLVE,
+	TRACE_HEADER,
+	TRACE_BODY,
+	TRACE_CLOSE,
+};
+
+extern int tracing;
+
+/*
+ * Phase timing for -t. With tracing off this costs one branch: take
+ * t = trace_now() where a phase starts and call trace_span() where it
+ * ends.
+ */
+#define trace_now() (tracing ? trace_clock() : 0)
+#define trace_span(phase, fd, start) do { if (tracing) trace_record(phase, fd, start); } while (0)
+
+void trace_init();
+void trace_record(int phase, int fd, unsigned long long start);
+void trace_dump(char *path);
+
+#endif
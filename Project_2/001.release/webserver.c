@@ -1,57 +1,89 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
 #include <time.h>
 #include <sys/socket.h>
 #include <linux/unistd.h>
 #include <arpa/inet.h>
 #include "webserver.h"
+#include "metrics.h"
+#include "cache.h"
+#include "header.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+#include "docroot.h"
+#include "pack.h"
+#include "timer.h"
+
+volatile sig_atomic_t stop = 0;
+
+void on_signal(int sig)
+{
+		stop = 1;
+}
 
 int listener(int port)
 {
 		int sock;
-		struct sockaddr_in sin;
-		struct sockaddr_in peer;
-		int peer_len = sizeof(peer);
-		int r;
-
-		sock = socket(AF_INET, SOCK_STREAM, 0);
-		sin.sin_family = AF_INET;
-		sin.sin_addr.s_addr = INADDR_ANY;
-		sin.sin_port = htons(port);
-		r = bind(sock, (struct sockaddr *) &sin, sizeof(sin));
-		if(r < 0) {
-				perror("Error binding socket:");
-				return -1;
-		}
 
-		r = listen(sock, 5);
-		if(r < 0) {
-				perror("Error listening socket:");
-				return -1;
-		}
+		sock = open_listener(port, conf.listeners > 0);
+		if (sock < 0) return -1;
 
 		printf("HTTP server listening on port %d\n", port);
-		while (1) {
+		fflush(stdout); // bench.sh waits for this line in a log file
+		while (!stop) {
 				int fd;
 				fd = accept(sock, NULL, NULL);
 				if (fd < 0) {
+						if (stop) break;
 						printf("Accept failed.\n");
 						break;
 				}
+				metrics_inc(accepts[0]);
+				trace_span(TRACE_ACCEPT, fd, 0);
 				process(fd);
 		}
 		close(sock);
+		log_flush();
+		if (conf.trace) trace_dump(conf.trace);
+		metrics_print(stdout);
+		return 0;
 
 }
 
 int main(int argc, char *argv[]) {
-		if(argc != 2 || atoi(argv[1]) < 2000 || atoi(argv[1]) > 50000)
+		int arg = config_parse(argc, argv);
+
+		if(arg < 0 || argc - arg != 1 || atoi(argv[arg]) < 2000 || atoi(argv[arg]) > 50000)
 		{
-				fprintf(stderr, "./webserver PORT(2001 ~ 49999)\n");
+				fprintf(stderr, "./webserver [options] PORT(2001 ~ 49999)\n");
+				config_usage();
 				return 0;
 		}
 
-		int port = atoi(argv[1]);
+		int port = atoi(argv[arg]);
+		struct sigaction sa;
+
+		// no SA_RESTART so that accept() returns and we get to print metrics
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_signal;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		signal(SIGPIPE, SIG_IGN);
+		// the current directory is the document root
+		if (docroot_init(".") < 0) return 1;
+		if (conf.pack && pack_open(conf.pack) < 0) return 1;
+		cache_init();
+		header_init();
+		log_init();
+		timer_init();
+		if (conf.trace) trace_init();
+		metrics.started = time(NULL);
+		metrics.workers = 1;
+
 		listener(port);
 
 		return 0;
@@ -8,8 +8,18 @@
 #else
 #define debug(M, ...) fprintf(stderr, "DEBUG(%s:%d) " M, __FILE__, __LINE__, ##__VA_ARGS__)
 #endif
+extern int CRASH;
+
+struct conn;
+
 int process(int fd);
+struct conn *conn_start(struct conn *c);
+struct conn *conn_open(int fd);
+int conn_serve(struct conn *c, int slice);
+int open_listener(int port, int reuseport);
+void send_unavailable(int fd);
 int gettid();
+char *get_mime_type(char *name);
 
 #endif
 
@@ -1,67 +1,686 @@
+#define _GNU_SOURCE // CPU_SET, pthread_attr_setaffinity_np()
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/epoll.h>
 #include "webserver.h"
+#include "cache.h"
+#include "header.h"
+#include "config.h"
+#include "metrics.h"
+#include "http.h"
+#include "log.h"
+#include "trace.h"
+#include "docroot.h"
+#include "pack.h"
+#include "timer.h"
 
 #define MAX_REQUEST 100
+#define SCALE_INTERVAL 500 // ms between autoscaler samples
+#define SCALE_UP_WAIT 50 // ms of queue wait, with no idle worker, that adds threads
+#define SCALE_DOWN_TICKS 10 // samples with spare workers and no waiting before threads are retired
 
 int port, numThread;
 
-void *listener()
+/*
+ * Accepted connections first wait on their pool's epoll set until the
+ * client has sent something, and only then in its queue for one of its
+ * workers; a persistent connection goes back to the epoll set between
+ * requests. An idle client thus costs a descriptor, never a worker. The
+ * pool's poller thread blocks while the ring is full, which leaves ready
+ * connections waiting in the epoll set, unless admission control (-q/-w)
+ * sheds them first.
+ *
+ * Connections in the middle of a large body come back through a second,
+ * lower priority lane (largeQueue, linked through conn->next and ordered
+ * by bytes left, shortest first). Workers only turn to it when no new
+ * connection is waiting, and at most all but conf.reserve workers may be
+ * busy with it, so a small request never waits for a big transfer to end.
+ *
+ * Normally there is one pool. With -a there is one per CPU, each with
+ * its own listener and workers pinned to that CPU, so a connection is
+ * accepted, parsed and answered on the core whose cache already holds
+ * its socket.
+ */
+struct job {
+	struct conn *c;
+	int resumed; // c comes off largeQueue, half way through a body
+	unsigned long long queued; // now_usec() when its client sent something
+};
+
+struct pool {
+	int cpu; // what its threads are pinned to, -1 for none
+	int ep; // epoll set of the connections waiting for their client
+	struct job request_buffer[MAX_REQUEST];
+	int buffer_in;
+	int buffer_out;
+	int buffer_count;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	int liveWorkers;
+
+	// protected by lock; the window is what the autoscaler has seen since its last sample
+	int idleWorkers;
+	int retireWorkers;
+	int windowMinIdle;
+	unsigned long long windowMaxWait;
+
+	struct conn *largeQueue;
+	int largeBusy;
+};
+
+struct pool *pools;
+int numPool = 1;
+int cpu_pool[CPU_SETSIZE]; // pool serving each CPU, -1 if this process does not run there
+
+int listen_socks[MAX_LISTENER];
+int numListener = 0;
+int liveWorkers = 0;
+
+// Called with p->lock held.
+int can_take_large(struct pool *p)
 {
-	int r;
-	struct sockaddr_in sin;
-	struct sockaddr_in peer;
-	int peer_len = sizeof(peer);
-	int sock;
+	int allowed = p->liveWorkers - conf.reserve;
+
+	return p->largeQueue != NULL && p->largeBusy < (allowed > 0 ? allowed : 1);
+}
+
+/*
+ * Queue c for the pool, or answer it with a 503 on the spot if the queue
+ * is longer than conf.max_queue or its head has waited longer than
+ * conf.max_wait. Waiting any longer would only let the client time out.
+ */
+void enqueue(struct pool *p, struct conn *c)
+{
+	unsigned long long now = now_usec();
+	int shed = 0;
+
+	pthread_mutex_lock(&p->lock);
+	if (conf.max_queue > 0 && p->buffer_count >= conf.max_queue) {
+		shed = 1;
+		metrics_inc(shed_depth);
+	} else if (conf.max_wait > 0 && p->buffer_count > 0
+			&& now - p->request_buffer[p->buffer_out].queued > conf.max_wait * 1000ULL) {
+		shed = 1;
+		metrics_inc(shed_wait);
+	} else {
+		while (p->buffer_count == MAX_REQUEST) pthread_cond_wait(&p->not_full, &p->lock);
+		p->request_buffer[p->buffer_in].c = c;
+		p->request_buffer[p->buffer_in].resumed = 0;
+		p->request_buffer[p->buffer_in].queued = now;
+		p->buffer_in = (p->buffer_in + 1) % MAX_REQUEST;
+		p->buffer_count++;
+		metrics_inc(queued);
+		pthread_cond_signal(&p->not_empty);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if (shed) {
+		timer_cancel(&c->deadline);
+		send_unavailable(c->fd);
+		conn_put(c);
+	}
+}
 
-	sock = socket(AF_INET, SOCK_STREAM, 0);
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(port);
-	r = bind(sock, (struct sockaddr *) &sin, sizeof(sin));
-	if(r < 0) {
-		perror("Error binding socket:");
-		return;
+// Fills in the next job and returns 0, or returns -1 if the calling worker is to retire.
+int dequeue(struct pool *p, struct job *job)
+{
+	unsigned long long wait;
+
+	pthread_mutex_lock(&p->lock);
+	p->idleWorkers++;
+	metrics_inc(idle);
+	while (p->buffer_count == 0 && !can_take_large(p) && p->retireWorkers == 0)
+		pthread_cond_wait(&p->not_empty, &p->lock);
+	p->idleWorkers--;
+	metrics_dec(idle);
+	if (p->buffer_count == 0 && !can_take_large(p)) {
+		p->retireWorkers--;
+		pthread_mutex_unlock(&p->lock);
+		return -1;
+	}
+	if (p->buffer_count == 0) {
+		job->c = p->largeQueue;
+		job->resumed = 1;
+		p->largeQueue = job->c->next;
+		p->largeBusy++;
+		pthread_mutex_unlock(&p->lock);
+		return 0;
 	}
+	*job = p->request_buffer[p->buffer_out];
+	p->buffer_out = (p->buffer_out + 1) % MAX_REQUEST;
+	p->buffer_count--;
+	metrics_dec(queued);
+	wait = now_usec() - job->queued;
+	if (wait > p->windowMaxWait) p->windowMaxWait = wait;
+	if (p->idleWorkers < p->windowMinIdle) p->windowMinIdle = p->idleWorkers;
+	pthread_cond_signal(&p->not_full);
+	pthread_mutex_unlock(&p->lock);
+
+	hist_record(&metrics.queue_wait, wait);
+	return 0;
+}
+
+// Called with p->lock held.
+void large_push(struct pool *p, struct conn *c)
+{
+	struct conn **pp;
+
+	for (pp = &p->largeQueue; *pp && (*pp)->body_left <= c->body_left; pp = &(*pp)->next);
+	c->next = *pp;
+	*pp = c;
+}
 
-	r = listen(sock, 5);
-	if(r < 0) {
-		perror("Error listening socket:");
-		return;
+// Finish a job; if the connection stopped halfway through a large body it joins largeQueue.
+void job_done(struct pool *p, struct job *job, struct conn *c, int sliced)
+{
+	pthread_mutex_lock(&p->lock);
+	if (job->resumed) p->largeBusy--;
+	if (sliced) {
+		large_push(p, c);
+		metrics_inc(slices);
 	}
+	if (sliced || job->resumed) pthread_cond_signal(&p->not_empty);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Leave c on the pool's epoll set until its client sends. The deadline
+ * armed for the request keeps running; when it fires it shuts the socket
+ * down, which wakes the poller too.
+ */
+void conn_wait(struct pool *p, struct conn *c)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = c;
+	metrics_inc(waiting);
+	if (epoll_ctl(p->ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+		perror("epoll_ctl");
+		metrics_dec(waiting);
+		timer_cancel(&c->deadline);
+		close(c->fd);
+		conn_put(c);
+	}
+}
+
+/*
+ * Queue the connections whose client has sent something, or whose
+ * deadline shut them down. The deadline is stopped for the time in the
+ * queue and the worker restarts it with what is left. A connection that
+ * never sent a thing is closed right here rather than handed to a worker.
+ */
+void *poller(void *arg)
+{
+	struct pool *p = arg;
+	struct epoll_event ev[64];
+	struct conn *c;
+	int i, n;
+
+	while (1) {
+		n = epoll_wait(p->ep, ev, 64, -1);
+		for (i = 0; i < n; i++) {
+			c = ev[i].data.ptr;
+			epoll_ctl(p->ep, EPOLL_CTL_DEL, c->fd, NULL);
+			metrics_dec(waiting);
+			c->left = timer_cancel(&c->deadline);
+			if (c->fresh && c->expired) {
+				metrics_inc(slow_read);
+				close(c->fd);
+				conn_put(c);
+				continue;
+			}
+			enqueue(p, c);
+		}
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Listener id feeds pool id when there is one per CPU. The kernel picks
+ * the listener whose SO_INCOMING_CPU matches the CPU the SYN arrived on;
+ * a connection that still lands on another CPU's listener is handed to
+ * the pool of the CPU its packets come in on.
+ */
+void *listener(void *arg)
+{
+	int id = (long) arg;
+	int sock = listen_socks[id];
+	struct pool *p = &pools[numPool > 1 ? id : 0];
+	struct conn *c;
+	int cpu, to;
+	socklen_t len;
+	unsigned long long t;
 
-	printf("HTTP server listening on port %d\n", port);
 	while (1)
 	{
 		int s;
 		s = accept(sock, NULL, NULL);
-		if (s < 0) break;
-
-		//process(s);
+		if (s < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) continue;
+			perror("Accept failed");
+			break;
+		}
+		metrics_inc(accepts[id]);
+		trace_span(TRACE_ACCEPT, s, 0);
+		t = trace_now();
+		to = p - pools;
+		len = sizeof(cpu);
+		if (numPool > 1 && getsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+				&& cpu >= 0 && cpu < CPU_SETSIZE && cpu_pool[cpu] >= 0 && cpu_pool[cpu] != to) {
+			to = cpu_pool[cpu];
+			metrics_inc(steered);
+		}
+		// the whole request head is due within REQUEST_TIMEOUT of the accept
+		c = conn_get(s);
+		c->fresh = 1;
+		c->waiting = 1;
+		timer_arm(&c->deadline, REQUEST_TIMEOUT * 1000);
+		conn_wait(&pools[to], c);
+		trace_span(TRACE_ENQUEUE, s, t);
 	}
 
 	close(sock);
+	return NULL;
+}
+
+/*
+ * Runs on the timer thread once a paced body may go on. The pool lock is
+ * only held for a list insert, and no one arms a timer under it, so this
+ * is as quick as the wheel needs.
+ */
+void conn_wake(struct timer *t)
+{
+	struct conn *c = (struct conn *) ((char *) t - offsetof(struct conn, wake));
+	struct pool *p = c->owner;
+
+	pthread_mutex_lock(&p->lock);
+	large_push(p, c);
+	pthread_cond_signal(&p->not_empty);
+	pthread_mutex_unlock(&p->lock);
 }
 
+// Leave a connection the rate limits hold back on the timer wheel, not on a worker.
+void conn_park(struct pool *p, struct conn *c)
+{
+	c->owner = p;
+	c->wake.fn = conn_wake;
+	c->wake.pprev = NULL;
+	timer_arm(&c->wake, (c->pace_wait + 999) / 1000);
+}
+
+int add_workers(struct pool *p, int n);
+
+// Returns how many workers the process has left.
+int worker_gone(struct pool *p)
+{
+	metrics_dec(workers);
+	__sync_fetch_and_sub(&p->liveWorkers, 1);
+	return __sync_sub_and_fetch(&liveWorkers, 1);
+}
+
+/*
+ * Runs when CRASH kills a worker through pthread_exit() in conn_start().
+ * In thread mode a replacement is started right away, or the pool would
+ * dwindle until connections are accepted and never served. A pre-forked
+ * child instead exits once its whole pool is gone, so the master
+ * replaces the process.
+ */
+void worker_exit(void *arg)
+{
+	struct pool *p = arg;
+
+	if (worker_gone(p) == 0 && conf.processes > 0) {
+		printf("[pid %d] all worker threads are gone, exiting\n", getpid());
+		exit(1);
+	}
+	if (conf.processes == 0) add_workers(p, 1);
+}
+
+void *worker(void *arg)
+{
+	struct pool *p = arg;
+	struct job job;
+	struct conn *c;
+	unsigned long long t;
+	int r;
+
+	pthread_cleanup_push(worker_exit, p);
+	while (1) {
+		t = trace_now();
+		if (dequeue(p, &job) < 0) break;
+		trace_span(TRACE_DEQUEUE, job.c->fd, t);
+		c = job.c->fresh ? conn_start(job.c) : job.c;
+		r = c ? conn_serve(c, 1) : 0;
+		job_done(p, &job, c, r == 1);
+		if (r == 2) conn_park(p, c);
+		else if (r == 3) conn_wait(p, c);
+	}
+	// retired by the autoscaler
+	pthread_cleanup_pop(0);
+	worker_gone(p);
+	return NULL;
+}
+
+// A detached thread, pinned to cpu unless it is -1.
+int start_thread(void *(*fn)(void *), void *arg, int cpu)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	cpu_set_t set;
+	int err;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	err = pthread_create(&tid, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+int add_workers(struct pool *p, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (start_thread(worker, p, p->cpu) != 0) {
+			perror("Failed to create worker thread");
+			break;
+		}
+		__sync_fetch_and_add(&p->liveWorkers, 1);
+		__sync_fetch_and_add(&liveWorkers, 1);
+		metrics_inc(workers);
+	}
+	return i;
+}
+
+/*
+ * Grow the pool when connections wait in the queue while no worker is
+ * idle, by half its size so a surge is met in a few steps. Shrink it one
+ * half of the spare workers at a time, and only after SCALE_DOWN_TICKS
+ * quiet samples in a row, so a short lull does not undo the growth and a
+ * pool at its right size does not oscillate. Only a single pool is scaled.
+ */
+void *autoscaler(void *arg)
+{
+	struct pool *p = &pools[0];
+	int quiet = 0;
+	int live, pending, minIdle, queued, n;
+	unsigned long long maxWait, oldest;
+
+	while (1) {
+		usleep(SCALE_INTERVAL * 1000);
+
+		pthread_mutex_lock(&p->lock);
+		minIdle = p->windowMinIdle;
+		maxWait = p->windowMaxWait;
+		queued = p->buffer_count;
+		oldest = queued > 0 ? now_usec() - p->request_buffer[p->buffer_out].queued : 0;
+		if (oldest > maxWait) maxWait = oldest;
+		pending = p->retireWorkers;
+		p->windowMinIdle = p->idleWorkers;
+		p->windowMaxWait = 0;
+		pthread_mutex_unlock(&p->lock);
+
+		live = p->liveWorkers - pending;
+		if (live < conf.min_threads) {
+			n = add_workers(p, conf.min_threads - live);
+			printf("[pid %d] pool %d -> %d threads: below minimum\n", getpid(), live, live + n);
+			quiet = 0;
+		} else if (minIdle == 0 && maxWait > SCALE_UP_WAIT * 1000ULL && live < conf.max_threads) {
+			n = live / 2 > 0 ? live / 2 : 1;
+			if (live + n > conf.max_threads) n = conf.max_threads - live;
+			n = add_workers(p, n);
+			printf("[pid %d] pool %d -> %d threads: queue wait %llu ms with no idle worker (%d queued)\n",
+				getpid(), live, live + n, maxWait / 1000, queued);
+			quiet = 0;
+		} else if (minIdle > 0 && queued == 0 && maxWait < SCALE_UP_WAIT * 1000ULL / 4 && live > conf.min_threads) {
+			if (++quiet < SCALE_DOWN_TICKS) continue;
+			n = minIdle / 2 > 0 ? minIdle / 2 : 1;
+			if (live - n < conf.min_threads) n = live - conf.min_threads;
+			pthread_mutex_lock(&p->lock);
+			p->retireWorkers += n;
+			pthread_cond_broadcast(&p->not_empty);
+			pthread_mutex_unlock(&p->lock);
+			printf("[pid %d] pool %d -> %d threads: at least %d idle for %d ms\n",
+				getpid(), live, live - n, minIdle, SCALE_DOWN_TICKS * SCALE_INTERVAL);
+			quiet = 0;
+		} else {
+			quiet = 0;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * With -l n every process opens its own n SO_REUSEPORT sockets, with -a
+ * one per pool that takes the connections arriving on its CPU; otherwise
+ * they share one.
+ */
+int open_listeners()
+{
+	int i;
+
+	numListener = numPool > 1 ? numPool : conf.listeners > 0 ? conf.listeners : 1;
+	for (i = 0; i < numListener; i++) {
+		if ((listen_socks[i] = open_listener(port, numPool > 1 || conf.listeners > 0)) < 0) return -1;
+		if (numPool > 1 && setsockopt(listen_socks[i], SOL_SOCKET, SO_INCOMING_CPU, &pools[i].cpu, sizeof(int)) < 0)
+			perror("Error setting SO_INCOMING_CPU");
+	}
+	return 0;
+}
+
+/*
+ * One pool, or with -a one per CPU this process may run on, as long as
+ * each still gets a worker. CPUs left without a pool of their own hand
+ * their connections to one round robin.
+ */
+void pools_init()
+{
+	int cpus[CPU_SETSIZE], ncpu = 0, i;
+	cpu_set_t set;
+
+	for (i = 0; i < CPU_SETSIZE; i++) cpu_pool[i] = -1;
+	if (conf.affinity && sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &set)) cpus[ncpu++] = i;
+	numPool = ncpu < numThread ? ncpu : numThread;
+	if (numPool > MAX_LISTENER) numPool = MAX_LISTENER;
+	if (numPool < 1) numPool = 1;
+
+	pools = calloc(numPool, sizeof(struct pool));
+	for (i = 0; i < numPool; i++) {
+		pools[i].cpu = ncpu > 0 ? cpus[i] : -1;
+		pthread_mutex_init(&pools[i].lock, NULL);
+		pthread_cond_init(&pools[i].not_empty, NULL);
+		pthread_cond_init(&pools[i].not_full, NULL);
+	}
+	for (i = 0; i < ncpu; i++) cpu_pool[cpus[i]] = i % numPool;
+}
+
+/*
+ * In the default mode one listener thread feeds the pool, through the
+ * pool's poller. With -l n there are n SO_REUSEPORT sockets on the port,
+ * each with its own accept thread, so a burst of SYNs is spread over n
+ * accept queues by the kernel. With -a each pool's listener, poller and
+ * workers run on the pool's CPU only.
+ */
 void thread_control()
 {
-	/* ----- */
+	pthread_t tid;
+	sigset_t set;
+	int i, sig;
+	char path[256];
+
+	// only the main thread takes SIGINT/SIGTERM, in sigwait() below
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (numListener == 0 && open_listeners() < 0) exit(1);
+	printf("[pid %d] HTTP server listening on port %d (%d listener%s, %d threads", getpid(), port,
+		numListener, numListener > 1 ? "s" : "", numThread);
+	if (conf.affinity) printf(" pinned to %d CPU%s", numPool, numPool > 1 ? "s" : "");
+	printf(")\n");
+	fflush(stdout); // bench.sh waits for this line in a log file
+
+	cache_init();
+	header_init();
+	log_init();
+	timer_init();
+	if (conf.trace) trace_init();
+	metrics.started = time(NULL);
+
+	for (i = 0; i < numPool; i++) {
+		if ((pools[i].ep = epoll_create1(EPOLL_CLOEXEC)) < 0 || start_thread(poller, &pools[i], pools[i].cpu) != 0) {
+			perror("Failed to start poller");
+			exit(1);
+		}
+	}
+	for (i = 0; i < numPool; i++) add_workers(&pools[i], numThread / numPool + (i < numThread % numPool));
+	if (conf.max_threads > 0 && pthread_create(&tid, NULL, autoscaler, NULL) == 0) pthread_detach(tid);
+	for (i = 0; i < numListener; i++) {
+		if (start_thread(listener, (void *) (long) i, pools[numPool > 1 ? i : 0].cpu) != 0)
+			perror("Failed to create listener thread");
+	}
+
+	sigwait(&set, &sig);
+	log_flush();
+	if (conf.trace && conf.processes > 0) {
+		snprintf(path, sizeof(path), "%s.%d", conf.trace, getpid());
+		trace_dump(path);
+	} else if (conf.trace) {
+		trace_dump(conf.trace);
+	}
+	if (conf.processes > 0) printf("[pid %d]\n", getpid());
+	metrics_print(stdout);
+	fflush(stdout);
+}
+
+pid_t spawn()
+{
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+
+	if (pid == 0) {
+		sigset_t set;
+
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		sigemptyset(&set);
+		sigaddset(&set, SIGCHLD);
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		thread_control();
+		exit(0);
+	}
+	if (pid < 0) perror("fork");
+	return pid;
+}
+
+/*
+ * Pre-forked mode: the master only forks conf.processes children, each
+ * running its own listener and worker threads, and replaces any child
+ * that dies. A crash then costs one process' in-flight connections
+ * instead of the whole server. The master stays single-threaded so that
+ * fork() is safe.
+ */
+void master()
+{
+	pid_t *children = calloc(conf.processes, sizeof(pid_t));
+	time_t *born = calloc(conf.processes, sizeof(time_t));
+	sigset_t set;
+	pid_t pid;
+	int i, sig, status;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	// without SO_REUSEPORT all children accept on the socket opened here
+	if (conf.listeners == 0 && numPool == 1 && open_listeners() < 0) exit(1);
+
+	for (i = 0; i < conf.processes; i++) {
+		children[i] = spawn();
+		born[i] = time(NULL);
+	}
+
+	while (1) {
+		sigwait(&set, &sig);
+		if (sig != SIGCHLD) break;
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < conf.processes && children[i] != pid; i++);
+			if (i == conf.processes) continue;
+			if (WIFSIGNALED(status))
+				printf("[master] worker process %d killed by signal %d, respawning\n", pid, WTERMSIG(status));
+			else
+				printf("[master] worker process %d exited with %d, respawning\n", pid, WEXITSTATUS(status));
+			// do not spin if children die on startup
+			if (time(NULL) - born[i] < 1) sleep(1);
+			children[i] = spawn();
+			born[i] = time(NULL);
+		}
+	}
+
+	for (i = 0; i < conf.processes; i++)
+		if (children[i] > 0) kill(children[i], SIGTERM);
+	while (wait(NULL) > 0);
+	free(children);
+	free(born);
 }
 
 int main(int argc, char *argv[])
 {
-	if(argc != 3 || atoi(argv[1]) < 2000 || atoi(argv[1]) > 50000)
+	int arg = config_parse(argc, argv);
+
+	if(arg < 0 || argc - arg != 2 || atoi(argv[arg]) < 2000 || atoi(argv[arg]) > 50000 || atoi(argv[arg + 1]) <= 0)
 	{
-		fprintf(stderr, "./webserver_multi PORT(2001 ~ 49999) #_of_threads\n");
+		fprintf(stderr, "./webserver_multi [options] PORT(2001 ~ 49999) #_of_threads\n");
+		config_usage();
 		return 0;
 	}
 
-	int i;
-	port = atoi(argv[1]);
-	numThread = atoi(argv[2]);
-	thread_control();
+	port = atoi(argv[arg]);
+	numThread = atoi(argv[arg + 1]);
+	if (conf.max_queue > MAX_REQUEST) conf.max_queue = MAX_REQUEST;
+	if (conf.max_threads > 0) {
+		if (conf.min_threads < 1) conf.min_threads = 1;
+		if (conf.max_threads < conf.min_threads) conf.max_threads = conf.min_threads;
+		if (numThread < conf.min_threads) numThread = conf.min_threads;
+		if (numThread > conf.max_threads) numThread = conf.max_threads;
+	}
+	if (conf.affinity && conf.max_threads > 0) {
+		fprintf(stderr, "-a keeps a fixed pool per CPU, ignoring -m/-M\n");
+		conf.max_threads = 0;
+	}
+	pools_init();
+	signal(SIGPIPE, SIG_IGN);
+	// the current directory is the document root
+	if (docroot_init(".") < 0) return 1;
+	if (conf.pack && pack_open(conf.pack) < 0) return 1;
+	if (conf.processes > 0) master();
+	else thread_control();
 	return 0;
 }
-